@@ -0,0 +1,156 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * latency histogram: percentiles and summary
+ */
+
+#include <stdint.h> /* uint64_t */
+#include <stdio.h> /* fprintf() */
+#include <string.h> /* memset() */
+
+#include "histogram.h"
+
+/* highest value that falls in the bucket `index` */
+static uint64_t
+bucket_highest_value(unsigned int index)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (index < HISTOGRAM_SUB_BUCKETS)
+		return index;
+
+	shift = index / HISTOGRAM_HALF_BUCKETS - 1;
+	sub = index - shift * HISTOGRAM_HALF_BUCKETS;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+/* lowest value that falls in the bucket `index` */
+static uint64_t
+bucket_lowest_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HISTOGRAM_SUB_BUCKETS)
+		return index;
+
+	shift = index / HISTOGRAM_HALF_BUCKETS - 1;
+
+	return (uint64_t) (index - shift * HISTOGRAM_HALF_BUCKETS) << shift;
+}
+
+/*
+ * out = a - b, where b is an earlier copy of a
+ *
+ * It gives the values recorded since b was taken. min and
+ * max are only known within the precision of the buckets.
+ */
+void
+histogram_subtract(struct histogram *out, struct histogram *a,
+                   struct histogram *b)
+{
+	unsigned int i;
+
+	histogram_reset(out);
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		out->counts[i] = a->counts[i] - b->counts[i];
+		if (!out->counts[i])
+			continue;
+
+		if (!out->total)
+			out->min = bucket_lowest_value(i);
+		out->max = bucket_highest_value(i);
+		out->total += out->counts[i];
+	}
+}
+
+/*
+ * Return the value below (or at) which `percentile` percent
+ * of the recorded values are. It's the highest value of the
+ * bucket, but never beyond the maximum recorded.
+ */
+uint64_t
+histogram_percentile(struct histogram *h, double percentile)
+{
+	double rank;
+	uint64_t wanted;
+	uint64_t count = 0;
+	uint64_t value;
+	unsigned int i;
+
+	if (h->total == 0)
+		return 0;
+
+	/* rank of the value, rounding up */
+	rank = percentile / 100.0 * h->total;
+	wanted = (uint64_t) rank;
+	if (wanted < rank || wanted == 0)
+		wanted++;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		count += h->counts[i];
+		if (count >= wanted)
+			break;
+	}
+
+	value = bucket_highest_value(i);
+	if (value > h->max)
+		value = h->max;
+	if (value < h->min)
+		value = h->min;
+
+	return value;
+}
+
+#define print_ms(file, name, ns) \
+	fprintf(file, "  %-7s %lu.%06lu ms\n", name, \
+	        (ns) / 1000000, (ns) % 1000000)
+
+/*
+ * NOTE: In multi thread mode this may be called while the
+ * receiver records values. The counters are read without
+ * synchronization, so the summary can be slightly off.
+ */
+void
+histogram_print(struct histogram *h, FILE *file, const char *title)
+{
+	fprintf(file, "%s (%lu values):\n", title, h->total);
+
+	if (h->total == 0)
+		return;
+
+	print_ms(file, "min",    h->min);
+	print_ms(file, "p50",    histogram_percentile(h, 50.0));
+	print_ms(file, "p90",    histogram_percentile(h, 90.0));
+	print_ms(file, "p99",    histogram_percentile(h, 99.0));
+	print_ms(file, "p99.9",  histogram_percentile(h, 99.9));
+	print_ms(file, "p99.99", histogram_percentile(h, 99.99));
+	print_ms(file, "max",    h->max);
+}
+
+void
+histogram_reset(struct histogram *h)
+{
+	memset(h->counts, 0, sizeof(h->counts));
+	h->total = 0;
+	h->min = UINT64_MAX;
+	h->max = 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * log-linear (HDR-like) histogram of nanosecond values
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS have their own
+ * bucket. Above it, every power of two is split in
+ * HISTOGRAM_SUB_BUCKETS / 2 linear buckets, so a value is
+ * known within 1 / 32 (~3%) of its magnitude. The whole
+ * uint64_t range fits in HISTOGRAM_BUCKETS counters, with
+ * no allocation.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h> /* uint64_t */
+#include <stdio.h> /* FILE* */
+
+#define HISTOGRAM_SUB_BITS     6
+#define HISTOGRAM_SUB_BUCKETS  (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+/* bucket groups (power of two) above the linear range */
+#define HISTOGRAM_GROUPS  (64 - HISTOGRAM_SUB_BITS + 1)
+#define HISTOGRAM_BUCKETS \
+	(HISTOGRAM_GROUPS * HISTOGRAM_HALF_BUCKETS + HISTOGRAM_HALF_BUCKETS)
+
+struct histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+static inline unsigned int
+histogram_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	/* position of the most significant bit, minus the sub bits */
+	shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+
+	/* (value >> shift) is in [HALF_BUCKETS, SUB_BUCKETS) */
+	return shift * HISTOGRAM_HALF_BUCKETS + (value >> shift);
+}
+
+/* O(1), it only touches one counter */
+static inline void
+histogram_record(struct histogram *h, uint64_t value)
+{
+	h->counts[histogram_index(value)]++;
+	h->total++;
+
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void
+histogram_subtract(struct histogram *out, struct histogram *a,
+                   struct histogram *b);
+
+uint64_t
+histogram_percentile(struct histogram *h, double percentile);
+
+void
+histogram_print(struct histogram *h, FILE *file, const char *title);
+
+void
+histogram_reset(struct histogram *h);
+
+#endif /* HISTOGRAM_H */
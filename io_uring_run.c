@@ -0,0 +1,572 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * io_uring run
+ *
+ * Same elements as the polling run (single_thread.c), but
+ * the file descriptors are watched by an io_uring instead
+ * of poll(), and the replies are read by the ring itself:
+ * a multishot recvmsg puts them in buffers we registered
+ * beforehand, so one io_uring_enter() waits for and
+ * receives any number of packets.
+ *
+ * The other file descriptors are watched with multishot
+ * poll requests and the elements do their job as usual.
+ * The sender still sends a burst with one sendmmsg() and
+ * the storer drains the error queue with recvmmsg():
+ * through the ring, the send would complete only after
+ * we had published its entries in the send history, and
+ * every error queue read would need its own request.
+ *
+ * liburing is not used, just the system calls.
+ */
+
+#define _GNU_SOURCE /* struct msghdr */
+
+#include <endian.h> /* __BYTE_ORDER */
+#include <errno.h> /* EINTR ENOBUFS */
+#include <poll.h> /* POLLIN POLLPRI */
+#include <signal.h> /* sigfillset */
+#include <stdint.h> /* uintptr_t */
+#include <stdio.h> /* printf() stdout */
+#include <stdlib.h> /* calloc() free() */
+#include <string.h> /* memset() */
+#include <sys/mman.h> /* mmap() munmap() */
+#include <sys/signalfd.h>
+#include <sys/socket.h> /* struct msghdr */
+#include <sys/syscall.h> /* __NR_io_uring_*  */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* close() read() syscall() */
+
+#include <linux/io_uring.h>
+
+#include "io_uring_run.h"
+#include "measurer_elements.h"
+
+#include "sender.h" /* sender_do_its_job() */
+#include "storer.h" /* storer_do_its_job() */
+#include "receiver.h" /* receiver_process_msg() */
+#include "histogram.h" /* histogram_print() */
+#include "stats.h" /* stats_do_its_job() */
+
+/*
+ * Replies are received in URING_BUFFERS buffers (a power
+ * of 2) of URING_BUFFER_SIZE bytes. Each one holds a
+ * struct io_uring_recvmsg_out, the control messages and
+ * the packet.
+ */
+#define URING_BUFFERS       512
+#define URING_BUFFER_SIZE   2048
+#define URING_CONTROL_SIZE  256
+/* buffer group of the replies */
+#define URING_BGID          0
+
+/* every buffer may be waiting in the completion ring */
+#define URING_SQ_ENTRIES    16
+#define URING_CQ_ENTRIES    (2 * URING_BUFFERS)
+
+/* registered files, also the user_data of their requests */
+enum {
+	SIGNAL_FD,
+	TIMER_FD,
+	SEND_FD,
+	RECV_FD,
+	STATS_FD,
+	N_FDS,
+};
+
+struct uring {
+	int fd;
+
+	/* submission and completion rings share one mapping */
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	/* requests queued since the last io_uring_enter() */
+	unsigned int to_submit;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* provided buffers (reply buffers) and their ring */
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	void *buffers;
+	unsigned short buf_tail;
+
+	/*
+	 * multishot recvmsg: only the name and control
+	 * lengths are used, to lay out the buffers
+	 */
+	struct msghdr recv_msg;
+};
+
+static int
+uring_enter(struct uring *u, unsigned int min_complete)
+{
+	int tmp;
+
+	tmp = syscall(__NR_io_uring_enter, u->fd, u->to_submit, min_complete,
+	              min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (tmp == -1)
+		return errno == EINTR ? 0 : -1;
+
+	u->to_submit -= tmp;
+	return 0;
+}
+
+/*
+ * Get a zeroed submission entry. If the submission ring is
+ * full, the queued requests are submitted first.
+ */
+static struct io_uring_sqe*
+uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *u->sq_tail;
+	unsigned int index;
+
+	while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)
+	       >= u->sq_entries) {
+		if (uring_enter(u, 0) == -1)
+			return NULL;
+	}
+
+	index = tail & u->sq_mask;
+	u->sq_array[index] = index;
+	sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+/* make the entry we got last visible to the kernel */
+static void
+uring_queue_sqe(struct uring *u)
+{
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+}
+
+/* watch a registered file until the request is cancelled */
+static int
+uring_poll(struct uring *u, int index, unsigned int events)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(u);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = index;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = events << 16 | events >> 16;
+#endif
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = index;
+
+	uring_queue_sqe(u);
+	return 0;
+}
+
+/* receive replies until the request is cancelled */
+static int
+uring_recv(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(u);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->fd = RECV_FD;
+	sqe->addr = (uintptr_t) &u->recv_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = RECV_FD;
+
+	uring_queue_sqe(u);
+	return 0;
+}
+
+/* give the buffer `bid` (back) to the kernel */
+static void
+uring_provide_buffer(struct uring *u, unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (uintptr_t) (u->buffers + bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+
+	u->buf_tail++;
+	__atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return 1 if the signal asks us to exit. SIGUSR1 only
+ * dumps the latency summary.
+ */
+static int
+handle_signal(struct measurer_elements *e, int signal_fd)
+{
+	struct signalfd_siginfo info;
+
+	if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+		return 0;
+
+	if (info.ssi_signo == SIGUSR1) {
+		histogram_print(&e->receiver->histogram, stdout,
+		                "round trip latency");
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * The buffer is laid out as the recvmsg template says: the
+ * header, the name (none), the control messages and the
+ * packet, possibly truncated.
+ */
+static int
+handle_reply(struct measurer_elements *e, struct uring *u,
+             struct io_uring_cqe *cqe, struct timespec *user_ts)
+{
+	struct io_uring_recvmsg_out *out;
+	struct msghdr msg;
+	unsigned short bid;
+	void *buffer;
+	void *data;
+	size_t len;
+	int ret;
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return 0;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buffer = u->buffers + bid * URING_BUFFER_SIZE;
+	out = buffer;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = buffer + sizeof(*out) + u->recv_msg.msg_namelen;
+	msg.msg_controllen = out->controllen;
+
+	data = msg.msg_control + u->recv_msg.msg_controllen;
+	len = out->payloadlen;
+	if (len > cqe->res - (data - buffer))
+		len = cqe->res - (data - buffer);
+
+	ret = receiver_process_msg(e->receiver, &msg, data, len,
+	                           e->receiver->rx_wakeup ? user_ts : NULL);
+
+	uring_provide_buffer(u, bid);
+	return ret;
+}
+
+/*
+ * Return -1 on error, 1 if we have to exit.
+ *
+ * A multishot request without IORING_CQE_F_MORE has
+ * ended (e.g. the receive ran out of buffers), so it's
+ * submitted again.
+ */
+static int
+handle_completion(struct measurer_elements *e, struct uring *u,
+                  struct io_uring_cqe *cqe, int signal_fd,
+                  struct timespec *user_ts)
+{
+	int index = cqe->user_data;
+	int ret = 0;
+
+	if (index == RECV_FD) {
+		if (cqe->res >= 0)
+			ret = handle_reply(e, u, cqe, user_ts);
+		else if (cqe->res != -ENOBUFS)
+			return -1;
+
+		if (!(cqe->flags & IORING_CQE_F_MORE) && uring_recv(u) == -1)
+			return -1;
+
+		return ret;
+	}
+
+	if (cqe->res < 0)
+		return -1;
+
+	switch (index) {
+	case SIGNAL_FD:
+		/* check the signal and exit */
+		if (handle_signal(e, signal_fd))
+			return 1;
+		break;
+	case TIMER_FD:
+		/* send the packets and store their ids in ring buffer */
+		if (sender_do_its_job(e->sender) == -1)
+			return -1;
+		break;
+	case SEND_FD:
+		if (storer_do_its_job(e->storer) == -1)
+			return -1;
+		break;
+	case STATS_FD:
+		/* write interval statistics */
+		if (stats_do_its_job(e->stats) == -1)
+			return -1;
+		break;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		if (uring_poll(u, index, index == SEND_FD ? POLLPRI : POLLIN)
+		    == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+run(struct measurer_elements *e, struct uring *u, int signal_fd)
+{
+	struct io_uring_cqe *cqe;
+	struct timespec user_ts;
+	unsigned int head;
+	unsigned int tail;
+	int keep_running = 1;
+
+	/* temporary */
+	int tmp;
+
+	if (uring_poll(u, SIGNAL_FD, POLLIN) == -1
+	    || uring_poll(u, TIMER_FD, POLLIN) == -1
+	    /* maybe POLLIN when SO_SELECT_ERRQUEUE is not available */
+	    || uring_poll(u, SEND_FD, POLLPRI) == -1
+	    || uring_recv(u) == -1)
+		return -1;
+	if (e->stats && uring_poll(u, STATS_FD, POLLIN) == -1)
+		return -1;
+
+	sender_timer_start(e->sender);
+	if (e->stats)
+		stats_timer_start(e->stats);
+
+	while (keep_running) {
+		/* submit the new requests and wait for a completion */
+		if (uring_enter(u, 1) == -1)
+			return -1;
+
+		/* when the replies reached us, once per wake-up */
+		if (e->receiver->rx_wakeup)
+			clock_gettime(CLOCK_REALTIME, &user_ts);
+
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			cqe = &u->cqes[head & u->cq_mask];
+
+			tmp = handle_completion(e, u, cqe, signal_fd,
+			                        &user_ts);
+			if (tmp == -1) {
+				return -1;
+			} else if (tmp == 1) {
+				/* Exiting here. TODO: Maybe it's temporary. */
+				keep_running = 0;
+			}
+		}
+
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+static void
+uring_cleanup(struct uring *u)
+{
+	/* the requests are cancelled when the ring is closed */
+	close(u->fd);
+	munmap(u->buf_ring, u->buf_ring_size);
+	free(u->buffers);
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->rings, u->rings_size);
+}
+
+/*
+ * The kernel must have the single mapping feature (5.4),
+ * the provided buffers ring (5.19) and the multishot
+ * recvmsg (6.0). Completion work is deferred to
+ * io_uring_enter() (6.1) when possible.
+ */
+static int
+uring_setup(struct uring *u, int *fds)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	size_t cq_size;
+	unsigned int i;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+	          IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = URING_CQ_ENTRIES;
+
+	u->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	if (u->fd == -1 && errno == EINVAL) {
+		p.flags = IORING_SETUP_CQSIZE;
+		u->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	}
+	if (u->fd == -1)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		goto _go_close_ring;
+
+	/* map the rings */
+	u->rings_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > u->rings_size)
+		u->rings_size = cq_size;
+
+	u->rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->rings == MAP_FAILED)
+		goto _go_close_ring;
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto _go_unmap_rings;
+
+	u->sq_head = u->rings + p.sq_off.head;
+	u->sq_tail = u->rings + p.sq_off.tail;
+	u->sq_array = u->rings + p.sq_off.array;
+	u->sq_mask = *(unsigned int*) (u->rings + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->to_submit = 0;
+
+	u->cq_head = u->rings + p.cq_off.head;
+	u->cq_tail = u->rings + p.cq_off.tail;
+	u->cq_mask = *(unsigned int*) (u->rings + p.cq_off.ring_mask);
+	u->cqes = u->rings + p.cq_off.cqes;
+
+	/* a negative fd leaves its slot empty */
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES,
+	            fds, N_FDS) == -1)
+		goto _go_unmap_sqes;
+
+	/* reply buffers */
+	u->buffers = calloc(URING_BUFFERS, URING_BUFFER_SIZE);
+	if (u->buffers == NULL)
+		goto _go_unmap_sqes;
+
+	/* the buffers ring must be page aligned */
+	u->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+	u->buf_ring = mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->buf_ring == MAP_FAILED)
+		goto _go_free_buffers;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) u->buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+	            &reg, 1) == -1)
+		goto _go_unmap_buf_ring;
+
+	u->buf_tail = 0;
+	for (i = 0; i < URING_BUFFERS; i++)
+		uring_provide_buffer(u, i);
+
+	memset(&u->recv_msg, 0, sizeof(u->recv_msg));
+	u->recv_msg.msg_controllen = URING_CONTROL_SIZE;
+
+	return 0;
+
+_go_unmap_buf_ring:
+	munmap(u->buf_ring, u->buf_ring_size);
+_go_free_buffers:
+	free(u->buffers);
+_go_unmap_sqes:
+	munmap(u->sqes, u->sqes_size);
+_go_unmap_rings:
+	munmap(u->rings, u->rings_size);
+_go_close_ring:
+	close(u->fd);
+	return -1;
+}
+
+#define set_and_goto(var, val, label) \
+	do { \
+		var = val; \
+		goto label; \
+	} while (0)
+
+int
+iouring_run(struct measurer_elements *e)
+{
+	int ret = 0;
+	sigset_t mask;
+	int signal_fd;
+	int fds[N_FDS];
+	struct uring u;
+
+	/* signal fd */
+	sigfillset(&mask);
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+	if (signal_fd == -1)
+		return 1;
+
+	fds[SIGNAL_FD] = signal_fd;
+	fds[TIMER_FD] = e->sender->tfd;
+	fds[SEND_FD] = e->sender->sfd;
+	fds[RECV_FD] = e->receiver->sfd;
+	fds[STATS_FD] = e->stats ? e->stats->tfd : -1;
+
+	if (uring_setup(&u, fds) == -1) {
+		printf("io_uring setup failed (Linux 6.0 or later needed)\n");
+		set_and_goto(ret, 1, _go_close_signalfd);
+	}
+
+	if (run(e, &u, signal_fd) == -1)
+		ret = 1;
+
+	uring_cleanup(&u);
+_go_close_signalfd:
+	close(signal_fd);
+	return ret;
+}
@@ -0,0 +1,27 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IO_URING_RUN_H
+#define IO_URING_RUN_H
+
+#include "measurer_elements.h"
+
+int
+iouring_run(struct measurer_elements *e);
+
+#endif /* IO_URING_RUN_H */
@@ -24,24 +24,36 @@
 
 /* link with -pthread */
 
-#define _GNU_SOURCE /* pipe2() */
-
 #include <arpa/inet.h> /* htons() */
-#include <fcntl.h> /* O_NONBLOCK */
+#include <ctype.h> /* isdigit() */
+#include <errno.h> /* errno */
 #include <netinet/in.h> /* inet_network() */
-#include <poll.h> /* POLL* */
 #include <pthread.h> /* pthread_*() */
 #include <signal.h> /* SIG_BLOCK */
 #include <stdint.h> /* int*_t */
 #include <stdio.h> /* printf() */
-#include <stdlib.h> /* atoi() */
-#include <string.h> /* strcmp() */
+#include <stdlib.h> /* atoi() strtol() strtoull() posix_memalign() */
+#include <string.h> /* strcmp() memset() */
+#include <sys/epoll.h> /* EPOLL* */
+#include <sys/mman.h> /* mlockall() */
+#include <sys/resource.h> /* getrusage() */
+#include <sys/eventfd.h> /* eventfd() */
 #include <sys/socket.h> /* bind() */
 #include <sys/types.h> /* bind() */
-#include <unistd.h> /* getopt() close() pipe() */
+#include <unistd.h> /* getopt() close() */
 
 #include <linux/net_tstamp.h> /* timestamp stuff */
 
+/* busy-poll: microseconds the kernel polls the device for */
+#define MEASURER_BUSY_POLL_US  50
+
+/* not in older headers */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL  69
+#endif
+
+#include "histogram.h"
+#include "probe.h"
 #include "result_buffer.h"
 #include "send_history.h"
 
@@ -49,9 +61,11 @@
 #include "receiver.h"
 #include "storer.h"
 #include "sender.h"
+#include "stats.h"
 
 #include "thread_context.h"
 
+#include "io_uring_run.h"
 #include "multi_thread.h"
 #include "single_thread.h"
 
@@ -59,16 +73,43 @@ struct measurer {
 	/* config */
 	uint32_t addr;
 	uint16_t port;
-	unsigned int sleep_ms;
+	uint64_t interval_ns;
 	unsigned int packet_count;
-	unsigned int max_latency;
+	uint64_t max_latency_ns;
+	/* precise pacing spin budget, disabled if zero */
+	uint64_t spin_ns;
+	int overrun_policy;
 	unsigned int result_buffering_size;
 	int is_multi_thread; /* boolean */
+	int is_io_uring; /* boolean */
 #ifdef SEND_COUNT
 	int n_to_send;
 #endif
 	int output_type;
 	char *writer_file;
+	/* O_DIRECT for the binary output file (boolean) */
+	int direct_output;
+	/* ring output size, in records */
+	uint64_t ring_records;
+	/* extended probes and mirror columns (boolean) */
+	int mirror_timestamps;
+	/* SEND_TIME_* from probe.h */
+	int send_time;
+	/* correlate TX timestamps with OPT_ID (boolean) */
+	int opt_id;
+	/* TX stages breakdown (boolean), see sender.h */
+	int tx_stages;
+	/* RX wake-up latency (boolean), see receiver.h */
+	int rx_wakeup;
+	/* busy-poll mode (boolean), its CPUs are in sched */
+	int busy_poll;
+	/* CPU and scheduling policy of every element (-A) */
+	struct thread_sched sched[N_ELEMENTS];
+	/* lock all memory, mlockall() (boolean) */
+	int lock_memory;
+	/* interval statistics, disabled if zero */
+	unsigned int stats_interval;
+	char *stats_file;
 
 
 	/* send and receive socket */
@@ -88,6 +129,7 @@ struct measurer {
 	struct receiver receiver;
 	struct storer   storer;
 	struct sender   sender;
+	struct stats    stats;
 };
 
 
@@ -107,18 +149,58 @@ print_help(void)
 	print_usage();
 	printf(
 "  -h Print this help.\n"
+"  -A <element>=<cpu>[,fifo:<prio>|,deadline:<run>:<dl>:<period>]\n"
+"     Run an element on <cpu> (-1 for any), optionally with a\n"
+"     real-time policy (SCHED_FIFO priority, or SCHED_DEADLINE\n"
+"     runtime, deadline and period, only with -1). Elements:\n"
+"     sender, storer, receiver, writer, stats (threads of -t)\n"
+"     and loop (the thread of the other modes). Repeatable.\n"
 "  -b <buffering_size> Number of entries to store before writing in file.\n"
+"  -B <cpu>[,<cpu>] Busy-poll mode (implies -t): the receiver and\n"
+"     the storer spin on the given CPUs (-1 for any; the storer's\n"
+"     defaults to the next one), with SO_BUSY_POLL set.\n"
 #ifdef SEND_COUNT
 "  -c <packets_to_send> Number of packets to send before exit.\n"
 "     Default: unlimited.\n"
 #endif
-"  -f [bin|csv|friendly (default)] Output type.\n"
-"     Friendly, binary, comma separated values.\n"
-"  -i <sleep_ms> (in milliseconds) Interval for sending packets.\n"
+"  -d Write the binary output file (-f bin|bin2 -o) with O_DIRECT.\n"
+"  -E [payload|merge] Put the send time (sender clock) in the\n"
+"     probes. payload: use it instead of the kernel timestamp,\n"
+"     with no send history (stateless, less accurate). merge:\n"
+"     use it only until the kernel timestamp is stored.\n"
+"  -f [bin|bin2|ring|csv|friendly (default)] Output type.\n"
+"     Friendly, binary, binary with header and nanoseconds\n"
+"     (see writer_format.h), the same records in a mapped\n"
+"     circular file (-o, see -r), comma separated values.\n"
+"  -i <interval> Interval for sending packets.\n"
+"  -I Match send timestamps to packets by the kernel counter\n"
+"     (SOF_TIMESTAMPING_OPT_ID), without a copy of the packet.\n"
+"  -L Lock all memory (mlockall()), so it's never paged out.\n"
+"  -M Ask the mirror for its timestamps (mirror -T) and write\n"
+"     the forward, mirror and reverse parts of the latency.\n"
+"     Forward and reverse need synchronized clocks.\n"
 "  -n <packet_count> Number of packets to send after every interval.\n"
 "  -o <output_file> File to write measurements (default stdout).\n"
+"  -O [abort (default)|skip|late] What to do when the send timer\n"
+"     overruns: exit, skip the missed intervals, or send their\n"
+"     packets late (flagged as late).\n"
+"  -p <spin> Precise pacing: wake up <spin> before the send time\n"
+"     and busy-wait until it. Meant for a dedicated core.\n"
+"  -r <records> Size of the ring output (default 1048576).\n"
+"  -R Measure how long replies wait in the socket until read\n"
+"     (RX wake-up latency). Adds a histogram and a column.\n"
+"  -s <seconds> Write statistics of every interval of <seconds>.\n"
+"  -S <stats_file> File to append statistics (default stderr).\n"
 "  -t Enable multi thread mode.\n"
-"  -W <timeout> (in milliseconds) Maximum latency allowed for packets.\n"
+"  -U Enable io_uring mode: single thread, the replies are\n"
+"     received by the ring (Linux 6.0 or later).\n"
+"  -W <timeout> Maximum latency allowed for packets.\n"
+"  -X Break the send down in stages: send call, qdisc (TX_SCHED)\n"
+"     and driver (TX_SOFTWARE). Adds histograms and columns.\n"
+"\n"
+"  <interval>, <timeout>, <spin>, <run>, <dl> and <period> take an\n"
+"  optional unit suffix:\n"
+"  ns, us, ms (default) or s. e.g. -i 50us\n"
 	);
 }
 
@@ -164,6 +246,31 @@ set_pollpri_on_errqueue(int sfd)
 	return 0;
 }
 
+/*
+ * SO_BUSY_POLL: a non-blocking read polls the device for
+ * new packets, instead of waiting for its interrupt.
+ * SO_PREFER_BUSY_POLL keeps the interrupts off while we
+ * do it, but it's only available since Linux 5.11, so it
+ * is not mandatory.
+ *
+ * NOTE: raising SO_BUSY_POLL above net.core.busy_read
+ * needs CAP_NET_ADMIN
+ */
+static int
+set_busy_poll(int sfd)
+{
+	int usec = MEASURER_BUSY_POLL_US;
+	int on = 1;
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &usec,
+	               sizeof(usec)) == -1)
+		return -1;
+
+	setsockopt(sfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+
+	return 0;
+}
+
 /* SO_TIMESTAMPING: timestamp packets */
 static int
 set_timestamp_opt(int fd, unsigned int opt)
@@ -184,6 +291,7 @@ static int
 setup_network(struct measurer *m)
 {
 	struct sockaddr_in recv_bind_addr;
+	unsigned int tx_opt;
 
 	/*
 	 * open receive socket
@@ -205,6 +313,9 @@ setup_network(struct measurer *m)
 	         sizeof(recv_bind_addr)) == -1)
 		goto _go_close_recv_socket;
 
+	if (m->busy_poll && set_busy_poll(m->recv_sfd) == -1)
+		goto _go_close_recv_socket;
+
 	/* TODO: allow user choose which type of timestamp he wants */
 	if (set_timestamp_opt(m->recv_sfd,
 	                      SOF_TIMESTAMPING_SOFTWARE |
@@ -220,6 +331,10 @@ setup_network(struct measurer *m)
 	if (m->send_sfd == -1)
 		goto _go_close_recv_socket;
 
+	/* stateless: the send time goes in the probe */
+	if (m->send_time == SEND_TIME_PAYLOAD)
+		return 0;
+
 	/*
 	 * allow to wake up only when data (timestamp in
 	 * this case) arrives in error queue
@@ -228,10 +343,24 @@ setup_network(struct measurer *m)
 		goto _go_close_send_socket;
 
 	/* TODO: allow user choose which type of timestamp he wants */
-	if (set_timestamp_opt(m->send_sfd,
-	                      SOF_TIMESTAMPING_SOFTWARE |
-	                      SOF_TIMESTAMPING_OPT_CMSG |
-	                      SOF_TIMESTAMPING_TX_SCHED) == -1)
+	tx_opt = SOF_TIMESTAMPING_SOFTWARE |
+	         SOF_TIMESTAMPING_OPT_CMSG |
+	         SOF_TIMESTAMPING_TX_SCHED;
+
+	/* TX stages: also when the packet is handed to the driver */
+	if (m->tx_stages)
+		tx_opt |= SOF_TIMESTAMPING_TX_SOFTWARE;
+
+	/*
+	 * With OPT_ID, the kernel numbers the packets and the
+	 * error queue carries only the control messages
+	 * (OPT_TSONLY), not a copy of the packet. The counter
+	 * starts from zero when the option is set.
+	 */
+	if (m->opt_id)
+		tx_opt |= SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if (set_timestamp_opt(m->send_sfd, tx_opt) == -1)
 		goto _go_close_send_socket;
 
 	return 0;
@@ -250,16 +379,16 @@ calculate_send_history_buffer_size(struct measurer *m)
 
 	/*
 	 * NOTE: maximum latency doesn't necessarily
-	 * need to be a multiple of sleep_ms
+	 * need to be a multiple of the interval
 	 */
 
 	/*
 	 * Calculate the number of wakeups of the sender
 	 * that happen until a packet expire.
-	 *   i.e. How many times sleep_ms fits in
-	 *   max_latency
+	 *   i.e. How many times interval_ns fits in
+	 *   max_latency_ns
 	 */
-	entries_to_keep = m->max_latency / m->sleep_ms;
+	entries_to_keep = m->max_latency_ns / m->interval_ns;
 	/*
 	 * we add one here because there may be some
 	 * remainder of the division
@@ -277,7 +406,6 @@ static void
 cleanup_send_history(struct measurer *m)
 {
 	free(m->send_history.buffer);
-	pthread_mutex_destroy(&m->send_history.mtx);
 }
 
 static int
@@ -285,10 +413,6 @@ setup_send_history(struct measurer *m)
 {
 	unsigned int buffer_size;
 
-	/* mutex lock to manage send history access */
-	if (pthread_mutex_init(&m->send_history.mtx, NULL) != 0)
-		return -1;
-
 	/*
 	 * The ring buffer's minimum size must have room
 	 * for at least elements that arrive at maximum
@@ -298,8 +422,12 @@ setup_send_history(struct measurer *m)
 	 * beginning should be expired.
 	 */
 	buffer_size = calculate_send_history_buffer_size(m);
-	m->send_history.buffer = calloc(buffer_size,
-	                                sizeof(struct sent_packet));
+	if (posix_memalign((void**) &m->send_history.buffer,
+	                   __alignof__(struct sent_packet),
+	                   buffer_size * sizeof(struct sent_packet)) != 0)
+		return -1;
+	memset(m->send_history.buffer, 0,
+	       buffer_size * sizeof(struct sent_packet));
 	m->send_history.control.size = buffer_size;
 	single_ring_buffer_reset(&m->send_history.control);
 
@@ -330,22 +458,19 @@ cleanup_result_buffer(struct measurer *m)
 	struct result_buffer *b = &m->result_buffer;
 
 	free(b->buffer);
-	close(b->readfd);
-	close(b->writefd);
+	close(b->efd);
 }
 
 static int
 setup_result_buffer(struct measurer *m)
 {
 	struct result_buffer *b = &m->result_buffer;
-	int tmp[2];
 
-	if (pipe2(tmp, O_NONBLOCK) == -1)
+	/* used to wake up the writer */
+	b->efd = eventfd(0, EFD_NONBLOCK);
+	if (b->efd == -1)
 		return -1;
 
-	b->readfd = tmp[0];
-	b->writefd = tmp[1];
-
 	/*
 	 * initialize the result buffer and its variables
 	 *
@@ -353,10 +478,30 @@ setup_result_buffer(struct measurer *m)
 	 * it's better to make the buffer size a multiple
 	 * of packet_count.
 	 */
-	b->size = m->result_buffering_size * sizeof(*b->buffer);
-	b->buffer = malloc(b->size);
 	b->boundary = m->result_buffering_size;
-	b->index = 0;
+
+	/*
+	 * The ring must be a power of two and hold some
+	 * batches, so the writer always has room to
+	 * consume while we fill the next one.
+	 */
+	b->size = RESULT_BUFFER_MIN_SIZE;
+	while (b->size < 4 * b->boundary)
+		b->size <<= 1;
+	b->mask = b->size - 1;
+
+	b->buffer = malloc(b->size * sizeof(*b->buffer));
+	if (b->buffer == NULL) {
+		close(b->efd);
+		return -1;
+	}
+
+	b->tail = 0;
+	b->head_cache = 0;
+	b->published_tail = 0;
+	b->head = 0;
+	/* the writer waits for the first results */
+	b->consumer_sleeping = 1;
 
 	/*
 	 * log the number of entries that couldn't be
@@ -367,9 +512,43 @@ setup_result_buffer(struct measurer *m)
 	return 0;
 }
 
+/* the header has the values of probe.h and sender.h */
+#if SEND_TIME_HISTORY != WRITER_SEND_TIME_HISTORY \
+    || SEND_TIME_PAYLOAD != WRITER_SEND_TIME_PAYLOAD \
+    || SEND_TIME_MERGE != WRITER_SEND_TIME_MERGE \
+    || SENDER_OVERRUN_ABORT != WRITER_OVERRUN_ABORT \
+    || SENDER_OVERRUN_SKIP != WRITER_OVERRUN_SKIP \
+    || SENDER_OVERRUN_LATE != WRITER_OVERRUN_LATE
+#error "SEND_TIME_*/SENDER_OVERRUN_* and writer_format.h differ"
+#endif
+
+/* the run configuration in the binary v2 header */
+static void
+set_file_header(struct measurer *m, struct writer_file_header *h)
+{
+	h->send_time = m->send_time;
+	h->addr = m->addr;
+	h->port = m->port;
+	h->interval_ns = m->interval_ns;
+	h->max_latency_ns = m->max_latency_ns;
+	h->packet_count = m->packet_count;
+	h->overrun_policy = m->overrun_policy;
+
+	if (m->is_io_uring)
+		h->run_mode = WRITER_RUN_IO_URING;
+	else if (m->busy_poll)
+		h->run_mode = WRITER_RUN_BUSY_POLL;
+	else if (m->is_multi_thread)
+		h->run_mode = WRITER_RUN_MULTI_THREAD;
+	else
+		h->run_mode = WRITER_RUN_SINGLE_THREAD;
+}
+
 static void
 cleanup_measurer(struct measurer *m)
 {
+	if (m->stats_interval)
+		stats_cleanup(&m->stats);
 	sender_cleanup(&m->sender);
 	storer_cleanup(&m->storer);
 	receiver_cleanup(&m->receiver);
@@ -404,12 +583,23 @@ setup_measurer(struct measurer *m)
 
 	/* writer thread */
 	if (thread_context_setup(&m->writer_thread, (void*) writer_do_its_job,
-	    &m->writer, m->result_buffer.readfd, POLLIN) == -1)
+	    &m->writer, m->result_buffer.efd, EPOLLIN) == -1)
 		goto _go_cleanup_result_buffer;
+	m->writer_thread.sched = m->sched[ELEMENT_WRITER];
 
 	/* writer */
 	m->writer.result_buffer = &m->result_buffer;
 	m->writer.output_type = m->output_type;
+	m->writer.direct = m->direct_output;
+	set_file_header(m, &m->writer.header);
+	m->writer.ring_records = m->ring_records;
+	m->writer.columns = 0;
+	if (m->mirror_timestamps)
+		m->writer.columns |= WRITER_COLUMN_MIRROR;
+	if (m->tx_stages)
+		m->writer.columns |= WRITER_COLUMN_TX_STAGES;
+	if (m->rx_wakeup)
+		m->writer.columns |= WRITER_COLUMN_RX_WAKEUP;
 	if (writer_setup(&m->writer, m->writer_file) == -1)
 		goto _go_writer_thread_cleanup;
 
@@ -417,12 +607,20 @@ setup_measurer(struct measurer *m)
 	m->receiver.result_buffer = &m->result_buffer;
 	m->receiver.send_history =  &m->send_history;
 	m->receiver.sfd = m->recv_sfd;
-	if (receiver_setup(&m->receiver, m->max_latency) == -1)
+	m->receiver.send_time = m->send_time;
+	m->receiver.tx_stages = m->tx_stages;
+	m->receiver.rx_wakeup = m->rx_wakeup;
+	m->receiver.report_duplicates =
+	  m->output_type == WRITER_OUTPUT_BINARY_V2
+	  || m->output_type == WRITER_OUTPUT_RING;
+	if (receiver_setup(&m->receiver, m->max_latency_ns) == -1)
 		goto _go_writer_cleanup;
 
 	/* storer */
 	m->storer.send_history = &m->send_history;
 	m->storer.sfd = m->send_sfd;
+	m->storer.opt_id = m->opt_id;
+	m->storer.tx_stages = m->tx_stages;
 	if (storer_setup(&m->storer) == -1)
 		goto _go_receiver_cleanup;
 
@@ -432,17 +630,33 @@ setup_measurer(struct measurer *m)
 #endif
 	m->sender.send_history = &m->send_history;
 	m->sender.sfd = m->send_sfd;
+	m->sender.overrun_policy = m->overrun_policy;
+	m->sender.mirror_timestamps = m->mirror_timestamps;
+	m->sender.send_time = m->send_time;
+	m->sender.tx_stages = m->tx_stages;
 #ifdef SEND_COUNT
 	m->sender.send_count = m->n_to_send;
-	m->sender.max_latency = m->max_latency;
+	m->sender.max_latency_ns = m->max_latency_ns;
 #endif
 	prepare_address(&m->sender.addr, m->addr, m->port);
-	if (sender_setup(&m->sender, m->sleep_ms, m->packet_count) == -1)
+	if (sender_setup(&m->sender, m->interval_ns, m->spin_ns,
+	                 m->packet_count) == -1)
 		goto _go_storer_cleanup;
 
+	/* interval statistics */
+	if (m->stats_interval) {
+		m->stats.sender = &m->sender;
+		m->stats.storer = &m->storer;
+		m->stats.receiver = &m->receiver;
+		m->stats.result_buffer = &m->result_buffer;
+		if (stats_setup(&m->stats, m->stats_interval,
+		    m->stats_file) == -1)
+			goto _go_sender_cleanup;
+	}
+
 	return 0;
 
-//_go_sender_cleanup:
+_go_sender_cleanup:
 	sender_cleanup(&m->sender);
 _go_storer_cleanup:
 	storer_cleanup(&m->storer);
@@ -461,6 +675,186 @@ _go_close_network:
 	return -1;
 }
 
+/*
+ * Parse a duration with an optional unit suffix (ns, us, ms
+ * or s) and return it in nanoseconds. Without suffix, it's
+ * in milliseconds. Return zero if it's invalid.
+ */
+static uint64_t
+parse_duration(const char *str)
+{
+	unsigned long long value;
+	uint64_t multiplier;
+	char *end;
+
+	/*
+	 * strtoull() takes "-1" (even after spaces) as a huge
+	 * number, so only digits may start the value
+	 */
+	if (!isdigit((unsigned char) *str))
+		return 0;
+
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno)
+		return 0;
+
+	if (*end == '\0' || strcmp(end, "ms") == 0)
+		multiplier = 1000000;
+	else if (strcmp(end, "ns") == 0)
+		multiplier = 1;
+	else if (strcmp(end, "us") == 0)
+		multiplier = 1000;
+	else if (strcmp(end, "s") == 0)
+		multiplier = 1000000000;
+	else
+		return 0;
+
+	/* zero is invalid, so it also means overflow */
+	if (value > UINT64_MAX / multiplier)
+		return 0;
+
+	return value * multiplier;
+}
+
+/* "<records>", the size of the ring output, not zero */
+static int
+parse_ring_records(struct measurer *m, const char *str)
+{
+	char *end;
+
+	/* see parse_duration() */
+	if (!isdigit((unsigned char) *str))
+		return -1;
+
+	errno = 0;
+	m->ring_records = strtoull(str, &end, 10);
+	if (errno || end == str || *end != '\0' || !m->ring_records)
+		return -1;
+
+	return 0;
+}
+
+/* "<receiver_cpu>[,<storer_cpu>]", see print_help() */
+static int
+parse_cpus(struct measurer *m, const char *str)
+{
+	int *receiver_cpu = &m->sched[ELEMENT_RECEIVER].cpu;
+	int *storer_cpu = &m->sched[ELEMENT_STORER].cpu;
+	char *end;
+
+	*receiver_cpu = strtol(str, &end, 10);
+	if (end == str || *receiver_cpu < -1)
+		return -1;
+
+	if (*end == '\0') {
+		*storer_cpu = *receiver_cpu == -1 ? -1 : *receiver_cpu + 1;
+		return 0;
+	}
+
+	if (*end != ',')
+		return -1;
+
+	str = end + 1;
+	*storer_cpu = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || *storer_cpu < -1)
+		return -1;
+
+	return 0;
+}
+
+static const char *element_names[N_ELEMENTS] = {
+	[ELEMENT_SENDER] =   "sender",
+	[ELEMENT_STORER] =   "storer",
+	[ELEMENT_RECEIVER] = "receiver",
+	[ELEMENT_WRITER] =   "writer",
+	[ELEMENT_STATS] =    "stats",
+	[ELEMENT_LOOP] =     "loop",
+};
+
+/*
+ * "<run>:<deadline>:<period>" of SCHED_DEADLINE. The kernel
+ * wants runtime <= deadline <= period.
+ */
+static int
+parse_deadline(struct thread_sched *s, char *str)
+{
+	uint64_t *values[] = {
+		&s->runtime_ns, &s->deadline_ns, &s->period_ns,
+	};
+	char *next;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		next = strchr(str, ':');
+		if ((next == NULL) != (i == 2))
+			return -1;
+		if (next != NULL)
+			*next++ = '\0';
+
+		*values[i] = parse_duration(str);
+		if (*values[i] == 0)
+			return -1;
+
+		str = next;
+	}
+
+	if (s->runtime_ns > s->deadline_ns || s->deadline_ns > s->period_ns)
+		return -1;
+
+	return 0;
+}
+
+/* "<element>=<cpu>[,<policy>]", see print_help() */
+static int
+parse_sched(struct measurer *m, char *str)
+{
+	struct thread_sched *s;
+	char *value;
+	char *end;
+	int i;
+
+	value = strchr(str, '=');
+	if (value == NULL)
+		return -1;
+	*value++ = '\0';
+
+	for (i = 0; i < N_ELEMENTS; i++) {
+		if (strcmp(str, element_names[i]) == 0)
+			break;
+	}
+	if (i == N_ELEMENTS)
+		return -1;
+
+	s = &m->sched[i];
+
+	s->cpu = strtol(value, &end, 10);
+	if (end == value || s->cpu < -1)
+		return -1;
+
+	if (*end == '\0')
+		return 0;
+	if (*end != ',')
+		return -1;
+
+	value = end + 1;
+	if (strncmp(value, "fifo:", 5) == 0) {
+		s->policy = SCHED_FIFO;
+		s->priority = strtol(value + 5, &end, 10);
+		if (end == value + 5 || *end != '\0'
+		    || s->priority < 1 || s->priority > 99)
+			return -1;
+	} else if (strncmp(value, "deadline:", 9) == 0) {
+		s->policy = SCHED_DEADLINE;
+		if (s->cpu != -1 || parse_deadline(s, value + 9) == -1)
+			return -1;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 parse_command_line_args(struct measurer *m, int argc, char **argv)
 {
@@ -468,28 +862,69 @@ parse_command_line_args(struct measurer *m, int argc, char **argv)
 
 	/* '+' = stop option processing when the first non-option is found */
 #ifdef SEND_COUNT
-	while ((c = getopt(argc, argv, "+b:c:f:i:n:o:thW:")) != -1) {
+#define OPTIONS "+A:b:B:c:dE:f:i:ILMn:o:O:p:r:Rs:S:thUW:X"
 #else
-	while ((c = getopt(argc, argv, "+b:f:i:n:o:thW:")) != -1) {
+#define OPTIONS "+A:b:B:dE:f:i:ILMn:o:O:p:r:Rs:S:thUW:X"
 #endif
+	while ((c = getopt(argc, argv, OPTIONS)) != -1) {
 		switch (c) {
+		case 'A':
+			if (parse_sched(m, optarg) == -1) {
+				printf("invalid element scheduling\n");
+				return -1;
+			}
+			break;
 		case 'b':
 			m->result_buffering_size = atoi(optarg);
 			break;
+		case 'B':
+			if (parse_cpus(m, optarg) == -1) {
+				printf("invalid busy-poll CPUs\n");
+				return -1;
+			}
+			m->busy_poll = 1;
+			m->is_multi_thread = 1;
+			break;
 #ifdef SEND_COUNT
 		case 'c':
 			if ((m->n_to_send = atoi(optarg)) <= 0)
 				m->n_to_send = -1;
 			break;
 #endif
+		case 'd':
+			m->direct_output = 1;
+			break;
+		case 'E':
+			if (strcmp(optarg, "payload") == 0) {
+				m->send_time = SEND_TIME_PAYLOAD;
+			} else if (strcmp(optarg, "merge") == 0) {
+				m->send_time = SEND_TIME_MERGE;
+			} else {
+				printf("invalid send time source\n");
+				return -1;
+			}
+			break;
 		case 'f':
 			if (strcmp(optarg, "bin") == 0)
 				m->output_type = WRITER_OUTPUT_BINARY;
+			else if (strcmp(optarg, "bin2") == 0)
+				m->output_type = WRITER_OUTPUT_BINARY_V2;
+			else if (strcmp(optarg, "ring") == 0)
+				m->output_type = WRITER_OUTPUT_RING;
 			else if (strcmp(optarg, "csv") == 0)
 				m->output_type = WRITER_OUTPUT_CSV;
 			break;
 		case 'i':
-			m->sleep_ms = atoi(optarg);
+			m->interval_ns = parse_duration(optarg);
+			break;
+		case 'I':
+			m->opt_id = 1;
+			break;
+		case 'L':
+			m->lock_memory = 1;
+			break;
+		case 'M':
+			m->mirror_timestamps = 1;
 			break;
 		case 'n':
 			m->packet_count = atoi(optarg);
@@ -498,12 +933,48 @@ parse_command_line_args(struct measurer *m, int argc, char **argv)
 			/* get filename where we'll write our measurements */
 			m->writer_file = optarg;
 			break;
+		case 'O':
+			if (strcmp(optarg, "abort") == 0) {
+				m->overrun_policy = SENDER_OVERRUN_ABORT;
+			} else if (strcmp(optarg, "skip") == 0) {
+				m->overrun_policy = SENDER_OVERRUN_SKIP;
+			} else if (strcmp(optarg, "late") == 0) {
+				m->overrun_policy = SENDER_OVERRUN_LATE;
+			} else {
+				printf("invalid overrun policy\n");
+				return -1;
+			}
+			break;
+		case 'p':
+			m->spin_ns = parse_duration(optarg);
+			break;
+		case 'r':
+			if (parse_ring_records(m, optarg) == -1) {
+				printf("invalid ring output size\n");
+				return -1;
+			}
+			break;
+		case 'R':
+			m->rx_wakeup = 1;
+			break;
+		case 's':
+			/* in seconds */
+			m->stats_interval = atoi(optarg);
+			break;
+		case 'S':
+			m->stats_file = optarg;
+			break;
 		case 't':
 			m->is_multi_thread = 1;
 			break;
+		case 'U':
+			m->is_io_uring = 1;
+			break;
 		case 'W':
-			/* in milliseconds */
-			m->max_latency = atoi(optarg);
+			m->max_latency_ns = parse_duration(optarg);
+			break;
+		case 'X':
+			m->tx_stages = 1;
 			break;
 		case 'h':
 		default:
@@ -514,12 +985,46 @@ parse_command_line_args(struct measurer *m, int argc, char **argv)
 
 	/* error if there are invalid option arguments */
 	if (!m->result_buffering_size || !m->packet_count
-	    || !m->sleep_ms || !m->max_latency) {
-		printf("result_buffering_size, sleep_ms, packet_count "
-		       "and max_latency cannot be zero\n");
+	    || !m->interval_ns || !m->max_latency_ns) {
+		printf("result_buffering_size, interval, packet_count "
+		       "and max_latency cannot be zero (or invalid)\n");
+		return -1;
+	}
+
+	if (m->is_io_uring && m->is_multi_thread) {
+		printf("-U is a single thread mode, not with -t or -B\n");
 		return -1;
 	}
 
+	if (m->direct_output && ((m->output_type != WRITER_OUTPUT_BINARY
+	    && m->output_type != WRITER_OUTPUT_BINARY_V2)
+	    || m->writer_file == NULL)) {
+		printf("-d is only for binary output to a file\n");
+		return -1;
+	}
+
+	if (m->output_type == WRITER_OUTPUT_RING && m->writer_file == NULL) {
+		printf("-f ring needs an output file\n");
+		return -1;
+	}
+
+	/* the stages come from the send history */
+	if (m->tx_stages && m->send_time == SEND_TIME_PAYLOAD) {
+		printf("-X needs the send history, not -E payload\n");
+		return -1;
+	}
+
+#ifdef WRITE_IN_SENDER
+	/*
+	 * The sender writes the results from the send
+	 * history, which doesn't keep the probe's send time.
+	 */
+	if (m->send_time != SEND_TIME_HISTORY) {
+		printf("-E is not supported with WRITE_IN_SENDER\n");
+		return -1;
+	}
+#endif
+
 	/* error if mandatory arguments weren't found */
 	if ((argc - optind) != 2) {
 		print_usage();
@@ -542,18 +1047,50 @@ parse_command_line_args(struct measurer *m, int argc, char **argv)
 static void
 set_default_args(struct measurer *m)
 {
+	int i;
+
 	/* defaults */
-	m->sleep_ms = 1000;
+	m->interval_ns = 1000000000;
 	m->packet_count = 1;
-	m->max_latency = 500;
+	m->max_latency_ns = 500000000;
+	m->spin_ns = 0;
+	m->overrun_policy = SENDER_OVERRUN_ABORT;
 	m->result_buffering_size = 1;
 	m->is_multi_thread = 0;
+	m->is_io_uring = 0;
 #ifdef SEND_COUNT
 	m->n_to_send = -1;
 #endif
 	m->output_type = WRITER_OUTPUT_FRIENDLY;
 	/* NULL defaults to standard output */
 	m->writer_file = NULL;
+	m->direct_output = 0;
+	m->ring_records = 1 << 20;
+	m->mirror_timestamps = 0;
+	m->send_time = SEND_TIME_HISTORY;
+	m->opt_id = 0;
+	m->tx_stages = 0;
+	m->rx_wakeup = 0;
+	m->busy_poll = 0;
+	for (i = 0; i < N_ELEMENTS; i++)
+		thread_sched_init(&m->sched[i]);
+	m->lock_memory = 0;
+	m->stats_interval = 0;
+	/* NULL defaults to standard error */
+	m->stats_file = NULL;
+}
+
+/* user plus system CPU time of all threads, in nanoseconds */
+static uint64_t
+cpu_time_ns(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		return 0;
+
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000
+	       + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
 }
 
 #define set_and_goto(var, val, label) \
@@ -568,6 +1105,7 @@ main(int argc, char **argv)
 	int ret = 0;
 	struct measurer m;
 	struct measurer_elements elements;
+	uint64_t cpu_time;
 
 	/* we catch signals in the run loop */
 	if (block_all_signals() == -1)
@@ -583,18 +1121,26 @@ main(int argc, char **argv)
 	/* print configuration information */
 	printf("result buffering size: %d\n"
 	       "packet count: %d\n"
-	       "send interval (sleep time): %d milliseconds\n"
-	       "maximum allowed latency: %d milliseconds\n"
+	       "send interval (sleep time): %lu.%06lu milliseconds\n"
+	       "maximum allowed latency: %lu.%06lu milliseconds\n"
 	       "output file: %s\n",
-	       m.result_buffering_size, m.packet_count, m.sleep_ms,
-	       m.max_latency, m.writer_file ? m.writer_file : "stdout");
+	       m.result_buffering_size, m.packet_count,
+	       m.interval_ns / 1000000, m.interval_ns % 1000000,
+	       m.max_latency_ns / 1000000, m.max_latency_ns % 1000000,
+	       m.writer_file ? m.writer_file : "stdout");
 
 	/*
-	 * start writer thread
-	 *
-	 * TODO: implement writer using the thread_ctx
-	 * structure from multi_thread.c
+	 * lock the memory allocated so far, and the stacks of
+	 * the threads to come (MCL_FUTURE)
 	 */
+	if (m.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		printf("could not lock memory (see RLIMIT_MEMLOCK)\n");
+		set_and_goto(ret, 1, _go_cleanup_measurer);
+	}
+
+	cpu_time = cpu_time_ns();
+
+	/* start writer thread */
 	if (thread_start(&m.writer_thread) == -1)
 		set_and_goto(ret, 1, _go_cleanup_measurer);
 
@@ -605,20 +1151,35 @@ main(int argc, char **argv)
 	 * single thread mode: Run all steps except writer
 	 * in a single thread by polling all file
 	 * descriptors.
+	 *
+	 * io_uring mode: Same as single thread mode, but
+	 * with an io_uring, which also receives the replies.
 	 */
 
 	elements.sender =   &m.sender;
 	elements.storer =   &m.storer;
 	elements.receiver = &m.receiver;
+	elements.stats =    m.stats_interval ? &m.stats : NULL;
+	elements.busy_poll = m.busy_poll;
+	elements.sched = m.sched;
 
-	if (m.is_multi_thread)
+	if (m.is_multi_thread) {
 		ret = multithread_run(&elements);
-	else
+	} else if (thread_sched_apply(&m.sched[ELEMENT_LOOP]) == -1) {
+		/* the loop of the single thread modes is this thread */
+		printf("could not set the CPU or scheduling of the loop\n");
+		ret = 1;
+	} else if (m.is_io_uring) {
+		ret = iouring_run(&elements);
+	} else {
 		ret = singlethread_run(&elements);
+	}
 
 	if (thread_terminate(&m.writer_thread))
 		ret = 1;
 
+	cpu_time = cpu_time_ns() - cpu_time;
+
 #ifdef WRITE_IN_SENDER
 	printf("Flushing send history\n");
 	sender_flush_send_history(&m.sender);
@@ -631,12 +1192,36 @@ main(int argc, char **argv)
 	printf("%ld packets sent\n", m.sender.total_packets_sent);
 	printf("%ld timestamps stored\n", m.storer.total_packets_stored);
 	printf("%ld packets received\n", m.receiver.valid_packets);
+	printf("%ld packets lost\n", m.sender.total_packets_lost);
+	printf("%ld timer overruns\n", m.sender.timer_overruns);
+	printf("%ld intervals skipped\n", m.sender.skipped_bursts);
+	printf("%ld packets sent late\n", m.sender.total_packets_late);
 	if (m.receiver.valid_packets) {
 		printf("average round trip latency: %ld.%06ld ms\n",
 		       m.receiver.nsec_sum /
 		         m.receiver.valid_packets / 1000000,
 		       m.receiver.nsec_sum /
 		         m.receiver.valid_packets % 1000000);
+		histogram_print(&m.receiver.histogram, stdout,
+		                "round trip latency");
+	}
+	histogram_print(&m.sender.departure_error, stdout,
+	                "send time error (behind schedule)");
+	if (m.rx_wakeup) {
+		histogram_print(&m.receiver.wakeup_latency, stdout,
+		                "rx wake-up latency");
+	}
+	if (m.tx_stages) {
+		histogram_print(&m.sender.send_syscall, stdout,
+		                "send calls duration (per burst)");
+		histogram_print(&m.storer.sched_delay, stdout,
+		                "send call to qdisc (TX_SCHED)");
+		histogram_print(&m.storer.queue_delay, stdout,
+		                "qdisc to driver (TX_SOFTWARE)");
+	}
+	if (m.sender.total_packets_sent) {
+		printf("cpu time per packet: %ld ns\n",
+		       cpu_time / m.sender.total_packets_sent);
 	}
 
 _go_cleanup_measurer:
@@ -26,12 +26,40 @@
 #include "sender.h" /* struct sender */
 #include "storer.h" /* struct storer */
 #include "receiver.h" /* struct receiver */
+#include "stats.h" /* struct stats */
+#include "thread_context.h" /* struct thread_sched */
+
+/*
+ * What can be scheduled on its own (-A): the threads of
+ * multi thread mode and the loop of the single thread
+ * modes.
+ */
+enum {
+	ELEMENT_SENDER,
+	ELEMENT_STORER,
+	ELEMENT_RECEIVER,
+	ELEMENT_WRITER,
+	ELEMENT_STATS,
+	ELEMENT_LOOP,
+	N_ELEMENTS,
+};
 
 /* TODO: make it not pointers and place it in measurer structure */
 struct measurer_elements {
 	struct sender   *sender;
 	struct storer   *storer;
 	struct receiver *receiver;
+	/* NULL if interval statistics are disabled */
+	struct stats    *stats;
+
+	/*
+	 * multi thread mode: the receiver and the storer spin
+	 * instead of waiting in the reactor (boolean)
+	 */
+	int busy_poll;
+
+	/* N_ELEMENTS entries, indexed by ELEMENT_* */
+	struct thread_sched *sched;
 };
 
 #endif /* MEASURER_ELEMENTS_H */
@@ -21,37 +21,106 @@
  *
  * Receive packets and send them back
  *
+ * Every worker thread has its own socket bound to the same
+ * port with SO_REUSEPORT, so the kernel spreads incoming
+ * packets among them. Workers can be pinned to CPUs.
+ *
+ * With a batch size greater than one, a worker receives up
+ * to that many packets with one recvmmsg() and sends them
+ * back with one sendmmsg(). Every packet keeps its own
+ * source address, so many measurers can share a mirror.
+ *
+ * With timestamping enabled, the mirror fills the kernel
+ * receive timestamp and its send time in the probes that
+ * have room for them. See probe.h
+ *
  * compile with:
- * $ gcc -o mirror mirror.c
+ * $ gcc -pthread -o mirror mirror.c
  */
 
+#define _GNU_SOURCE /* CPU_SET() pthread_attr_setaffinity_np() */
+
 #include <arpa/inet.h> /* htons */
+#include <errno.h> /* errno E* */
+#include <pthread.h> /* pthread_*() */
+#include <sched.h> /* cpu_set_t */
+#include <signal.h> /* sigwait() */
 #include <stdio.h> /* printf */
 #include <stdint.h> /* uint64_t */
-#include <stdlib.h> /* atoi */
+#include <stdlib.h> /* atoi calloc */
+#include <string.h> /* strerror() */
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <unistd.h> /* close */
+#include <sys/socket.h> /* recvmmsg() sendmmsg() */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* close getopt getpid */
 
-int
-main(int argc, char **argv)
-{
+#include <linux/net_tstamp.h> /* SOF_TIMESTAMPING_* */
+
+#include "probe.h"
+#include "time_common.h" /* get_timestamp_from_msg() */
+
+/* room for the receive timestamp control message */
+#define MIRROR_CONTROL_SIZE  256
+
+struct worker {
+	pthread_t thread;
 	int fd;
-	struct sockaddr_in saddr;
+	/* network byte order */
 	uint16_t port;
-	int tmp;
-	uint64_t buf;
-	socklen_t addrlen;
 
-	if (argc < 2) {
-		printf("usage: cmd <port>\n");
-		return 1;
-	}
-	port = htons(atoi(argv[1]));
+	/* fill the mirror timestamps in the probes (boolean) */
+	int timestamps;
+
+	/*
+	 * messages received at once (up to `batch`). The
+	 * single packet mode uses only the first one.
+	 */
+	int batch;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_in *addrs;
+	struct probe *bufs;
+	char (*controls)[MIRROR_CONTROL_SIZE];
+
+	/* log */
+	uint64_t packets;
+	/* replies dropped, the socket buffer was full */
+	uint64_t dropped;
+};
+
+static void
+print_usage(void)
+{
+	printf("usage: cmd [-n <threads>] [-c <first_cpu>] [-b <batch>] "
+	       "[-T] <port>\n"
+	       "  -n <threads> Number of worker threads (default 1).\n"
+	       "  -c <first_cpu> Pin worker i to CPU <first_cpu> + i.\n"
+	       "  -b <batch> Reflect up to <batch> packets per syscall\n"
+	       "     (default 1).\n"
+	       "  -T Put the receive timestamp and the send time in\n"
+	       "     the probes that have room for them.\n");
+}
+
+static int
+open_socket(uint16_t port, int timestamps)
+{
+	struct sockaddr_in saddr;
+	int on = 1;
+	int fd;
 
 	fd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (fd == -1)
-		return 1;
+		return -1;
+
+	/* every worker binds its own socket to the port */
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+		goto _go_close_fd;
+
+	/* software timestamps (CLOCK_REALTIME) of received packets */
+	on = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE;
+	if (timestamps && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING,
+	                             &on, sizeof(on)) == -1)
+		goto _go_close_fd;
 
 	saddr.sin_family = AF_INET;
 	saddr.sin_port = port;
@@ -60,29 +129,413 @@ main(int argc, char **argv)
 	if (bind(fd, (struct sockaddr*) &saddr, sizeof(saddr)) == -1)
 		goto _go_close_fd;
 
+	return fd;
+
+_go_close_fd:
+	close(fd);
+	return -1;
+}
+
+static int
+alloc_batch(struct worker *w)
+{
+	int i;
+
+	w->msgs = calloc(w->batch, sizeof(*w->msgs));
+	w->iovs = calloc(w->batch, sizeof(*w->iovs));
+	w->addrs = calloc(w->batch, sizeof(*w->addrs));
+	w->bufs = calloc(w->batch, sizeof(*w->bufs));
+	w->controls = calloc(w->batch, sizeof(*w->controls));
+	if (w->msgs == NULL || w->iovs == NULL || w->addrs == NULL ||
+	    w->bufs == NULL || w->controls == NULL)
+		return -1;
+
+	for (i = 0; i < w->batch; i++) {
+		w->iovs[i].iov_base = &w->bufs[i];
+		w->msgs[i].msg_hdr.msg_iov = &w->iovs[i];
+		w->msgs[i].msg_hdr.msg_iovlen = 1;
+		w->msgs[i].msg_hdr.msg_name = &w->addrs[i];
+		w->msgs[i].msg_hdr.msg_control = w->controls[i];
+	}
+
+	return 0;
+}
+
+static void
+free_batch(struct worker *w)
+{
+	free(w->msgs);
+	free(w->iovs);
+	free(w->addrs);
+	free(w->bufs);
+	free(w->controls);
+}
+
+static int
+worker_setup(struct worker *w)
+{
+	if (alloc_batch(w) == -1)
+		goto _go_free_batch;
+
+	w->fd = open_socket(w->port, w->timestamps);
+	if (w->fd == -1)
+		goto _go_free_batch;
+
+	return 0;
+
+_go_free_batch:
+	/* calloc()'d, so a partial allocation is fine */
+	free_batch(w);
+	return -1;
+}
+
+static void
+worker_cleanup(struct worker *w)
+{
+	close(w->fd);
+	free_batch(w);
+}
+
+/* make the first `count` messages ready to be received */
+static void
+prepare_receive(struct worker *w, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		w->iovs[i].iov_len = sizeof(w->bufs[i]);
+		w->msgs[i].msg_hdr.msg_namelen = sizeof(w->addrs[i]);
+		w->msgs[i].msg_hdr.msg_controllen =
+		  w->timestamps ? sizeof(w->controls[i]) : 0;
+	}
+}
+
+static uint64_t
+realtime_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return timespec_to_nanoseconds(&now);
+}
+
+/*
+ * Turn the first `count` messages received into replies.
+ *
+ * Reply every packet to its own source address, but to
+ * the port specified in command line. The reply has the
+ * length of the received packet.
+ */
+static void
+prepare_reply(struct worker *w, int count)
+{
+	struct scm_timestamping *ts;
+	struct msghdr *msg;
+	uint64_t tx_ns = 0;
+	int i;
+
+	/* the send time is taken once for the whole batch */
+	if (w->timestamps)
+		tx_ns = realtime_ns();
+
+	for (i = 0; i < count; i++) {
+		msg = &w->msgs[i].msg_hdr;
+
+		w->addrs[i].sin_port = w->port;
+		w->iovs[i].iov_len = w->msgs[i].msg_len;
+
+		if (!w->timestamps)
+			continue;
+
+		/* only extended probes have room for timestamps */
+		if (w->msgs[i].msg_len >= sizeof(struct probe)) {
+			ts = get_timestamp_from_msg(msg);
+			w->bufs[i].mirror_rx_ns =
+			  ts ? timespec_to_nanoseconds(&ts->ts[0]) : 0;
+			w->bufs[i].mirror_tx_ns = tx_ns;
+		}
+
+		/* don't send the received control messages back */
+		msg->msg_controllen = 0;
+	}
+}
+
+/*
+ * A reply couldn't be queued, the socket buffer is full.
+ * It's dropped: retrying would just spin while the
+ * requests wait in the receive queue.
+ */
+static int
+is_full_error(int error)
+{
+	return error == ENOBUFS || error == EAGAIN;
+}
+
+/*
+ * A worker can't go on. Its socket would still get its
+ * share of the flows (SO_REUSEPORT), so wake up main to
+ * exit instead of dropping them silently.
+ */
+static void*
+worker_failed(const char *call)
+{
+	printf("worker: %s: %s\n", call, strerror(errno));
+	kill(getpid(), SIGTERM);
+	return NULL;
+}
+
+static void*
+worker_routine_batch(void *data)
+{
+	struct worker *w = data;
+	int received;
+	int dropped;
+	int sent;
+	int tmp;
+
 	for (;;) {
-		addrlen = sizeof(saddr);
+		prepare_receive(w, w->batch);
+		dropped = 0;
 
-		tmp = recvfrom(fd, &buf, sizeof(buf), 0,
-		               (struct sockaddr*) &saddr, &addrlen);
-		if (tmp == -1)
-			break;
+		/* block for the first packet only */
+		received = recvmmsg(w->fd, w->msgs, w->batch,
+		                    MSG_WAITFORONE, NULL);
+		if (received == -1) {
+			if (errno == EINTR)
+				continue;
+			return worker_failed("recvmmsg()");
+		}
+
+		prepare_reply(w, received);
 
 		/*
-		 * It's returned source port in saddr.
-		 * We want to send to the port specified
-		 * in command line.
+		 * sendmmsg() may send less than asked, and fails
+		 * only if the first message can't be sent
 		 */
-		saddr.sin_port = port;
+		for (sent = 0; sent < received; sent += tmp) {
+			tmp = sendmmsg(w->fd, w->msgs + sent,
+			               received - sent, 0);
+			if (tmp != -1)
+				continue;
+
+			if (errno == EINTR) {
+				tmp = 0;
+			} else if (is_full_error(errno)) {
+				/* drop the reply, go on with the next */
+				dropped++;
+				tmp = 1;
+			} else {
+				return worker_failed("sendmmsg()");
+			}
+		}
+
+		w->packets += received - dropped;
+		w->dropped += dropped;
+	}
+
+	return NULL;
+}
+
+static void*
+worker_routine(void *data)
+{
+	struct worker *w = data;
+	struct msghdr *msg = &w->msgs[0].msg_hdr;
+	int tmp;
+
+	for (;;) {
+		prepare_receive(w, 1);
+
+		tmp = recvmsg(w->fd, msg, 0);
+		if (tmp == -1) {
+			if (errno == EINTR)
+				continue;
+			return worker_failed("recvmsg()");
+		}
+		w->msgs[0].msg_len = tmp;
+
+		prepare_reply(w, 1);
+
+		while ((tmp = sendmsg(w->fd, msg, 0)) == -1
+		       && errno == EINTR)
+			;
+
+		if (tmp == -1) {
+			if (!is_full_error(errno))
+				return worker_failed("sendmsg()");
+			w->dropped++;
+			continue;
+		}
+
+		w->packets++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Start a worker already bound to `cpu` (-1 for any), so
+ * it never serves packets from another CPU
+ */
+static int
+start_worker(struct worker *w, int cpu)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int ret = -1;
+
+	/* NOTE: pthread_*() return error numbers */
+	if (pthread_attr_init(&attr) != 0)
+		return -1;
+
+	if (cpu != -1) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_attr_setaffinity_np(&attr, sizeof(set),
+		                                &set) != 0)
+			goto _go_destroy_attr;
+	}
+
+	if (pthread_create(&w->thread, &attr, w->batch > 1 ?
+	                   worker_routine_batch : worker_routine, w) == 0)
+		ret = 0;
+
+_go_destroy_attr:
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+static void
+wait_for_signal(void)
+{
+	sigset_t mask;
+	int sig = 0;
+
+	while (1) {
+		sigfillset(&mask);
+		sigwait(&mask, &sig);
+
+		switch (sig) {
+		case SIGINT:
+		case SIGQUIT:
+		case SIGTERM:
+			return;
+		}
+	}
+}
+
+static void
+print_rates(struct worker *workers, int n, struct timespec *start)
+{
+	struct timespec stop;
+	double elapsed;
+	uint64_t total = 0;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	elapsed = (stop.tv_sec - start->tv_sec) +
+	          (stop.tv_nsec - start->tv_nsec) / 1e9;
 
-		tmp = sendto(fd, &buf, sizeof(buf), 0,
-		             (struct sockaddr*) &saddr, addrlen);
-		if (tmp == -1)
+	for (i = 0; i < n; i++) {
+		printf("worker %d: %lu packets, %.0f packets/s, "
+		       "%lu replies dropped\n", i, workers[i].packets,
+		       workers[i].packets / elapsed, workers[i].dropped);
+		total += workers[i].packets;
+	}
+	printf("total: %lu packets, %.0f packets/s\n", total,
+	       total / elapsed);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct worker *workers;
+	struct timespec start;
+	sigset_t mask;
+	uint16_t port;
+	int n_workers = 1;
+	int batch = 1;
+	int timestamps = 0;
+	int first_cpu = -1;
+	int ret = 1;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "+b:c:n:Th")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'c':
+			first_cpu = atoi(optarg);
+			break;
+		case 'n':
+			n_workers = atoi(optarg);
 			break;
+		case 'T':
+			timestamps = 1;
+			break;
+		case 'h':
+		default:
+			print_usage();
+			return 1;
+		}
 	}
 
-_go_close_fd:
-	close(fd);
+	if (argc - optind < 1 || n_workers <= 0 || batch <= 0) {
+		print_usage();
+		return 1;
+	}
+	port = htons(atoi(argv[optind]));
 
-	return 0;
+	/* we catch signals in wait_for_signal(), workers inherit it */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	workers = calloc(n_workers, sizeof(*workers));
+	if (workers == NULL)
+		return 1;
+
+	for (i = 0; i < n_workers; i++) {
+		workers[i].port = port;
+		workers[i].batch = batch;
+		workers[i].timestamps = timestamps;
+		if (worker_setup(&workers[i]) == -1)
+			goto _go_cleanup_workers;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < n_workers; i++) {
+		if (start_worker(&workers[i], first_cpu == -1 ?
+		                 -1 : first_cpu + i) == -1) {
+			if (first_cpu == -1)
+				printf("could not start worker %d\n", i);
+			else
+				printf("could not start worker %d on CPU %d\n",
+				       i, first_cpu + i);
+			goto _go_cancel_workers;
+		}
+	}
+
+	wait_for_signal();
+	ret = 0;
+
+_go_cancel_workers:
+	/* recv and send syscalls are cancellation points */
+	while (i--) {
+		pthread_cancel(workers[i].thread);
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	if (ret == 0)
+		print_rates(workers, n_workers, &start);
+
+	i = n_workers;
+_go_cleanup_workers:
+	while (i--)
+		worker_cleanup(&workers[i]);
+	free(workers);
+
+	return ret;
 }
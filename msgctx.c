@@ -25,9 +25,11 @@
  * http://pubs.opengroup.org/onlinepubs/9699919799/basedefs/sys_socket.h.html
  */
 
+#define _GNU_SOURCE /* recvmmsg() */
+
 #include <string.h> /* memset() */
 #include <stdlib.h> /* calloc() */
-#include <sys/socket.h> /* recvmsg() */
+#include <sys/socket.h> /* recvmsg() recvmmsg() */
 #include <sys/types.h> /* recvmsg() */
 
 #include "msgctx.h"
@@ -124,3 +126,86 @@ msgctx_init(struct msgctx *mctx, size_t buffer_len, size_t control_len,
 
 	return 0;
 }
+
+/*
+ * Return the number of messages received, or -1 if there
+ * is none (or on error).
+ *
+ * Only msg_namelen and msg_controllen are reset (see
+ * msgctx_recv()). The control buffers are not cleared:
+ * the kernel sets msg_controllen to what it has written.
+ */
+int
+mmsgctx_recv(int sfd, struct mmsgctx *m, int flags)
+{
+	struct msghdr *msg;
+	unsigned int i;
+
+	for (i = 0; i < m->count; i++) {
+		msg = &m->msgs[i].msg_hdr;
+		msg->msg_namelen = m->name_len;
+		msg->msg_controllen = m->control_len;
+	}
+
+	return recvmmsg(sfd, m->msgs, m->count, flags, NULL);
+}
+
+void
+mmsgctx_destroy(struct mmsgctx *m)
+{
+	free(m->memory);
+}
+
+/* keep every buffer aligned, cmsghdr needs it */
+#define MMSGCTX_ALIGN(len)  (((len) + 7) & ~(size_t) 7)
+
+/*
+ * Same layout as msgctx_init(), but with `count` messages
+ * one after another in memory. The mmsghdr and iovec arrays
+ * come first.
+ */
+int
+mmsgctx_init(struct mmsgctx *m, unsigned int count, size_t buffer_len,
+             size_t control_len, size_t addr_len)
+{
+	struct msghdr *msg;
+	unsigned int i;
+
+	void *tmp;
+
+	m->memory = calloc(count, sizeof(*m->msgs) + sizeof(*m->iovs) +
+	                          MMSGCTX_ALIGN(addr_len) +
+	                          MMSGCTX_ALIGN(control_len) +
+	                          MMSGCTX_ALIGN(buffer_len));
+	if (m->memory == NULL)
+		return -1;
+
+	m->count = count;
+	m->name_len = addr_len;
+	m->control_len = control_len;
+
+	tmp = m->memory;
+	m->msgs = tmp;
+	tmp += count * sizeof(*m->msgs);
+	m->iovs = tmp;
+	tmp += count * sizeof(*m->iovs);
+
+	for (i = 0; i < count; i++) {
+		msg = &m->msgs[i].msg_hdr;
+
+		msg->msg_name = addr_len ? tmp : NULL;
+		tmp += MMSGCTX_ALIGN(addr_len);
+
+		msg->msg_control = control_len ? tmp : NULL;
+		tmp += MMSGCTX_ALIGN(control_len);
+
+		m->iovs[i].iov_len = buffer_len;
+		m->iovs[i].iov_base = tmp;
+		tmp += MMSGCTX_ALIGN(buffer_len);
+
+		msg->msg_iovlen = 1;
+		msg->msg_iov = &m->iovs[i];
+	}
+
+	return 0;
+}
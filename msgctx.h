@@ -48,6 +48,47 @@ struct msgctx {
 	size_t len;
 };
 
+/*
+ * multi-message variant of struct msgctx
+ *
+ * Up to `count` messages are received in a single
+ * recvmmsg() call. Addresses, control buffers and data
+ * buffers of all messages live in one contiguous arena.
+ *
+ * struct mmsghdr is only defined with _GNU_SOURCE, so
+ * the accessors below are macros and only the files that
+ * use them need it.
+ */
+struct mmsgctx {
+	/* memory used in recvmmsg() */
+	void *memory;
+
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+
+	/* maximum number of messages per recvmmsg() call */
+	unsigned int count;
+
+	/* per-message lengths, which can be modified by the kernel */
+	size_t name_len;
+	size_t control_len;
+};
+
+/* message header and data of the i-th message received */
+#define mmsgctx_msg(m, i)   (&(m)->msgs[i].msg_hdr)
+#define mmsgctx_data(m, i)  ((m)->iovs[i].iov_base)
+#define mmsgctx_len(m, i)   ((m)->msgs[i].msg_len)
+
+int
+mmsgctx_recv(int sfd, struct mmsgctx *m, int flags);
+
+void
+mmsgctx_destroy(struct mmsgctx *m);
+
+int
+mmsgctx_init(struct mmsgctx *m, unsigned int count, size_t buffer_len,
+             size_t control_len, size_t addr_len);
+
 int
 msgctx_recv(int sfd, struct msgctx *mctx, int flags);
 
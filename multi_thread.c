@@ -20,19 +20,21 @@
  * 14/05/2018
  */
 
-#include <poll.h> /* POLL* */
 #include <signal.h> /* sigfillset() sigwait() */
 #include <stdio.h> /* printf() */
+#include <sys/epoll.h> /* EPOLL* */
 
 #include "measurer_elements.h"
 
+#include "histogram.h" /* histogram_print() */
 #include "receiver.h" /* receiver_thread_routine() */
 #include "storer.h" /* storer_thread_routine() */
 #include "sender.h" /* sender_thread_routine() */
+#include "stats.h" /* stats_do_its_job() */
 #include "thread_context.h" /* struct thread_ctx */
 
 static void
-wait_for_signal(void)
+wait_for_signal(struct measurer_elements *e)
 {
 	sigset_t mask;
 	int sig = 0;
@@ -46,6 +48,11 @@ wait_for_signal(void)
 		case SIGINT:
 		case SIGQUIT:
 			return;
+		case SIGUSR1:
+			/* dump latency summary without stopping */
+			histogram_print(&e->receiver->histogram, stdout,
+			                "round trip latency");
+			break;
 		}
 	}
 }
@@ -84,44 +91,94 @@ enum {
 	LAST,
 };
 
+static const char *thread_names[LAST] = {
+	[RECEIVER] = "receiver",
+	[STORER] =   "storer",
+	[SENDER] =   "sender",
+};
+
+/* how much of a CPU the spinning threads took */
+static void
+print_spin_usage(struct thread_ctx *threads)
+{
+	int i;
+
+	for (i = 0; i < LAST; i++) {
+		if (!threads[i].spin || !threads[i].wall_ns)
+			continue;
+
+		printf("%s spin loop: %lu ms of CPU in %lu ms (%lu%%)\n",
+		       thread_names[i], threads[i].cpu_ns / 1000000,
+		       threads[i].wall_ns / 1000000,
+		       threads[i].cpu_ns * 100 / threads[i].wall_ns);
+	}
+}
+
 int
 multithread_run(struct measurer_elements *e)
 {
 	int ret = 0;
 	struct thread_ctx threads[LAST];
+	struct thread_ctx stats_thread;
 	int i;
 
 	if (thread_context_setup(&threads[RECEIVER],
 	    (void*) receiver_do_its_job, e->receiver,
-	    e->receiver->sfd, POLLIN) == -1)
+	    e->receiver->sfd, EPOLLIN) == -1)
 		return 1;
 
 	if (thread_context_setup(&threads[STORER],
 	    (void*) storer_do_its_job, e->storer,
-	    e->storer->sfd, POLLPRI) == -1)
+	    e->storer->sfd, EPOLLPRI) == -1)
 		set_and_goto(ret, 1, _go_cleanup_receiver);
 
 	if (thread_context_setup(&threads[SENDER],
 	    (void*) sender_do_its_job, e->sender,
-	    e->sender->tfd, POLLIN) == -1)
+	    e->sender->tfd, EPOLLIN) == -1)
 		set_and_goto(ret, 1, _go_cleanup_storer);
 
+	threads[RECEIVER].sched = e->sched[ELEMENT_RECEIVER];
+	threads[STORER].sched = e->sched[ELEMENT_STORER];
+	threads[SENDER].sched = e->sched[ELEMENT_SENDER];
+
+	/* their sockets are non-blocking */
+	if (e->busy_poll) {
+		threads[RECEIVER].spin = 1;
+		threads[STORER].spin = 1;
+	}
+
+	/* interval statistics are optional */
+	if (e->stats && thread_context_setup(&stats_thread,
+	    (void*) stats_do_its_job, e->stats,
+	    e->stats->tfd, EPOLLIN) == -1)
+		set_and_goto(ret, 1, _go_cleanup_sender);
+	if (e->stats)
+		stats_thread.sched = e->sched[ELEMENT_STATS];
+
 	/* start threads */
 	for (i = 0; i < LAST; i++) {
 		if (thread_start(&threads[i]) == -1)
 			set_and_goto(ret, 1, _go_terminate_threads);
 	}
 
-	/* start sender timer fd */
+	if (e->stats && thread_start(&stats_thread) == -1)
+		set_and_goto(ret, 1, _go_terminate_threads);
+
+	/* start sender (and stats) timer fd */
 	sender_timer_start(e->sender);
+	if (e->stats)
+		stats_timer_start(e->stats);
 
 	printf("All threads started\n");
 
 	/* wait for signal, then proceed exiting */
-	wait_for_signal();
+	wait_for_signal(e);
 
 	printf("Terminating threads\n");
 
+	if (e->stats && thread_terminate(&stats_thread))
+		ret = 1;
+
 _go_terminate_threads:
 	/* wake up and wait for all threads to terminate */
 	while (i--) {
@@ -129,7 +186,11 @@ _go_terminate_threads:
 			ret = 1;
 	}
 
-//_go_cleanup_sender:
+	print_spin_usage(threads);
+
+	if (e->stats)
+		thread_context_cleanup(&stats_thread);
+_go_cleanup_sender:
 	thread_context_cleanup(&threads[SENDER]);
 _go_cleanup_storer:
 	thread_context_cleanup(&threads[STORER]);
@@ -0,0 +1,69 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * layout of the probe packets, shared by the measurer and
+ * the mirror
+ *
+ * A probe starts with the header: the id (lower 40 bits)
+ * and the flags (upper 24 bits). See send_history.h
+ *
+ * An extended probe (measurer `-M` or `-E`) is the whole
+ * struct probe. It may carry the sender clock at send time
+ * (measurer `-E`), so the receiver doesn't need the send
+ * history, and has room for the mirror timestamps. A mirror
+ * with timestamping enabled (mirror `-T`) fills them in
+ * place before sending the probe back, otherwise they
+ * return as zero.
+ *
+ * All times are CLOCK_REALTIME in nanoseconds, like the
+ * kernel software timestamps taken by the measurer.
+ *
+ * NOTE: the fields are in host byte order, as the header
+ * always has been.
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h> /* uint64_t */
+
+struct probe {
+	uint64_t header;
+
+	/* sender clock right before sending, zero if not used */
+	uint64_t send_ns;
+
+	/* kernel timestamp when the mirror received the probe */
+	uint64_t mirror_rx_ns;
+	/* mirror clock right before sending the probe back */
+	uint64_t mirror_tx_ns;
+};
+
+/* size of a probe with only the header */
+#define PROBE_HEADER_SIZE  sizeof(uint64_t)
+
+/* where the receiver takes the send time from */
+
+/* kernel timestamp in the send history, see storer.c */
+#define SEND_TIME_HISTORY  0
+/* sender clock in the probe, no send history at all */
+#define SEND_TIME_PAYLOAD  1
+/* kernel timestamp if already stored, otherwise the probe's */
+#define SEND_TIME_MERGE    2
+
+#endif /* PROBE_H */
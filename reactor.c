@@ -0,0 +1,100 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * event loop
+ *
+ * The file descriptors are registered once in an epoll
+ * instance and every wake-up returns only the ready ones,
+ * so the cost of a wake-up doesn't grow with the number
+ * of sources. Used by the polling run (single_thread.c)
+ * and by every thread_ctx (thread_context.c).
+ */
+
+#include <errno.h> /* EINTR */
+#include <sys/epoll.h>
+#include <unistd.h> /* close() */
+
+#include "reactor.h"
+
+/* maximum number of ready sources handled per wake-up */
+#define REACTOR_MAX_EVENTS  16
+
+/* `s` must live while it's registered */
+int
+reactor_add(struct reactor *r, struct reactor_source *s, uint32_t events)
+{
+	struct epoll_event event;
+
+	event.events = events | EPOLLET;
+	event.data.ptr = s;
+
+	return epoll_ctl(r->epfd, EPOLL_CTL_ADD, s->fd, &event);
+}
+
+/*
+ * Wait for the sources and call their handlers until one
+ * returns REACTOR_STOP (return 0) or fails (return -1).
+ *
+ * The events (e.g. EPOLLERR) are not checked, a handler
+ * that finds nothing to read just returns.
+ */
+int
+reactor_run(struct reactor *r)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct reactor_source *s;
+	int count;
+	int tmp;
+	int i;
+
+	while (1) {
+		count = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (i = 0; i < count; i++) {
+			s = events[i].data.ptr;
+
+			tmp = s->handler(s->data);
+			if (tmp == -1)
+				return -1;
+			else if (tmp == REACTOR_STOP)
+				return 0;
+		}
+	}
+}
+
+void
+reactor_cleanup(struct reactor *r)
+{
+	close(r->epfd);
+}
+
+int
+reactor_setup(struct reactor *r)
+{
+	r->epfd = epoll_create1(0);
+	if (r->epfd == -1)
+		return -1;
+
+	return 0;
+}
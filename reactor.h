@@ -0,0 +1,58 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h> /* uint32_t */
+#include <sys/epoll.h> /* EPOLL* */
+
+/* returned by a handler to make reactor_run() return */
+#define REACTOR_STOP  1
+
+/*
+ * A file descriptor and what to do when it's ready. The
+ * handler returns 0 to go on, -1 on error or REACTOR_STOP.
+ *
+ * Sources are edge-triggered: the handler is only called
+ * again when something new arrives, so it must read all
+ * that is available (the fd must be non-blocking).
+ */
+struct reactor_source {
+	int fd;
+	int (*handler)(void*);
+	void *data;
+};
+
+struct reactor {
+	int epfd;
+};
+
+int
+reactor_add(struct reactor *r, struct reactor_source *s, uint32_t events);
+
+int
+reactor_run(struct reactor *r);
+
+void
+reactor_cleanup(struct reactor *r);
+
+int
+reactor_setup(struct reactor *r);
+
+#endif /* REACTOR_H */
@@ -22,63 +22,128 @@
  * receive packets from mirror and get their timestamps
  */
 
-#include <pthread.h> /* pthread_mutex_*() */
+#define _GNU_SOURCE /* struct mmsghdr */
 
 /* for struct sockaddr_in */
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include <time.h> /* clock_gettime() */
+
 #include <linux/errqueue.h> /* scm_timestamping */
 
 #include "receiver.h"
 
+#include "histogram.h"
 #include "msgctx.h"
+#include "probe.h"
 #include "result_buffer.h"
 #include "send_history.h"
 #include "time_common.h"
 
-#define EFATAL  2
+/* maximum number of packets read in one recvmmsg() */
+#define RECEIVER_BATCH_SIZE  64
 
 /* NOTE: attention to the endianness! */
 
+/*
+ * Get the send time the sender put in the probe (see
+ * SEND_TIME_* in probe.h). It must not be after the receive
+ * timestamp, which is taken from the same clock.
+ */
 static int
-process_packet(struct receiver *r, struct msgctx *mctx)
+get_payload_send_ts(struct probe *probe, size_t len,
+                    struct timespec *recv_ts, struct timespec *send_ts)
+{
+	if (len < sizeof(*probe) || !probe->send_ns)
+		return -1;
+
+	nanoseconds_to_timespec(send_ts, probe->send_ns);
+	if (time_is_greater(send_ts, recv_ts))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * On success, the result to be sent to the writer is put
+ * in `result`.
+ *
+ * `user_ts` is the clock right after the packet was read,
+ * or NULL if the RX wake-up latency is not measured.
+ */
+static int
+process_packet(struct receiver *r, struct msghdr *msg, void *data,
+               size_t len, struct timespec *user_ts, struct result *result)
 {
 	/* pointer to packet timestamp in control message */
 	struct scm_timestamping *ts;
 
+	struct timespec send_ts;
+	/* TX stages */
+	struct timespec userspace_ts = { 0 };
+	struct timespec sw_ts = { 0 };
 	struct timespec diff;
+	uint64_t nsec;
+	int64_t wakeup_ns = 0;
 
-	uint64_t *packet_header;
+	struct probe *probe;
 	uint64_t id;
+	uint64_t state;
 	struct sent_packet *send_info;
-#ifndef WRITE_IN_SENDER
-	struct sent_packet copy;
-	struct result tmp_result;
-#endif
 
-	if (mctx->len < sizeof(uint64_t))
-		goto _go_drop_packet;
+	if (len < PROBE_HEADER_SIZE)
+		return -1;
 
-	packet_header = mctx->data;
+	probe = data;
 
-	id = *packet_header & 0x000000ffffffffff;
+	id = probe->header & 0x000000ffffffffff;
 	/* error if packet ID is invalid */
 	if (id >= r->send_history->packet_id_boundary)
-		goto _go_drop_packet;
+		return -1;
 
 	/* get timestamp from message struct */
-	ts = get_timestamp_from_msg(&mctx->msg);
+	ts = get_timestamp_from_msg(msg);
 	/* error if packet doesn't carry timestamp */
 	if (ts == NULL)
-		goto _go_drop_packet;
+		return -1;
 
-	/* NOTE: enter critical region */
-	pthread_mutex_lock(&r->send_history->mtx);
+	result->flags = 0;
+
+	/* the flags the sender put in the probe */
+	if (probe->header >> PACKET_FLAGS_SHIFT & PACKET_LATE)
+		result->flags |= RESULT_LATE;
+
+	/* RX wake-up: how long the packet waited in the socket */
+	if (user_ts != NULL) {
+		wakeup_ns = result_timespec_diff_ns(user_ts, &ts->ts[0]);
+		if (wakeup_ns < 0)
+			wakeup_ns = 0;
+	}
+
+	/*
+	 * stateless: the send time comes in the probe and
+	 * the send history is not touched. Duplicates can't
+	 * be detected.
+	 */
+	if (r->send_time == SEND_TIME_PAYLOAD) {
+		if (get_payload_send_ts(probe, len, &ts->ts[0],
+		                        &send_ts) == -1)
+			return -1;
+		result->flags |= RESULT_PAYLOAD_SEND_TIME;
+
+		time_diff(&diff, &ts->ts[0], &send_ts);
+		if (time_is_greater(&diff, &r->max_latency))
+			return -1;
+
+		goto _go_valid;
+	}
 
 	send_info =
 	  &r->send_history->buffer[id % r->send_history->control.size];
 
+	state = sent_packet_load(send_info);
+
 	/*
 	 * It's not necessary to check for a SENT flag
 	 * because packets that are in the buffer were
@@ -89,113 +154,210 @@ process_packet(struct receiver *r, struct msgctx *mctx)
 	 * id is equal to the value used to initialize
 	 * the buffer (zero), so it may be received
 	 * without being sent.
+	 *
+	 * The checks are repeated if the state changes
+	 * before we set the received flag.
 	 */
+	do {
+		/*
+		 * Error if packet id is invalid. Probably a
+		 * timeout happened and the packet was already
+		 * overwritten. TODO: log it
+		 */
+		if (sent_packet_id(state) != id)
+			return -1;
 
-	/*
-	 * Error if packet id is invalid. Probably a
-	 * timeout happened and the packet was already
-	 * overwritten. TODO: log it
-	 */
-	if (send_info->id != id)
-		goto _go_unlock_mutex_and_drop_packet;
-
-	/*
-	 * Error if packet was already received. Maybe the
-	 * packet got duplicated! TODO: log it
-	 */
-	if (send_info->flags & PACKET_RECEIVED) {
-		r->duplicate_packets++;
-		goto _go_unlock_mutex_and_drop_packet;
-	}
-
-	/*
-	 * Error if send timestamp did not arrive in storer.
-	 * TODO: log it
-	 */
-	if (!(send_info->flags & PACKET_TIMESTAMPED))
-		goto _go_unlock_mutex_and_drop_packet;
-
-	/*
-	 * Error if timeout was already reached.
-	 * TODO: log it
-	 */
-	time_diff(&diff, &ts->ts[0], &send_info->ts);
-	if (time_is_greater(&diff, &r->max_latency))
-		goto _go_unlock_mutex_and_drop_packet;
-
-#ifndef WRITE_IN_SENDER
-	/* copy entry before exit the critical region */
-	copy = *send_info;
-#endif
+		/*
+		 * Error if packet was already received. Maybe the
+		 * packet got duplicated! TODO: log it
+		 */
+		if (sent_packet_flags(state) & PACKET_RECEIVED) {
+			r->duplicate_packets++;
+			if (!r->report_duplicates)
+				return -1;
+
+			/* a result with no round trip */
+			result->flags |= RESULT_DUPLICATE;
+			result->id = id;
+			result->diff.tv_sec = 0;
+			result->diff.tv_nsec = 0;
+			result->send_ts.tv_sec = 0;
+			result->send_ts.tv_nsec = 0;
+			if (sent_packet_flags(state) & PACKET_TIMESTAMPED)
+				result->send_ts = send_info->ts;
+			result->recv_ts = ts->ts[0];
+			return 0;
+		}
+
+		/*
+		 * Error if send timestamp did not arrive in
+		 * storer, unless we can fall back to the send
+		 * time in the probe. TODO: log it
+		 */
+		if (sent_packet_flags(state) & PACKET_TIMESTAMPED) {
+			send_ts = send_info->ts;
+			userspace_ts = send_info->userspace_ts;
+			sw_ts = send_info->sw_ts;
+			result->flags &= ~RESULT_PAYLOAD_SEND_TIME;
+		} else if (r->send_time == SEND_TIME_MERGE &&
+		           sent_packet_flags(state) & PACKET_SENT &&
+		           get_payload_send_ts(probe, len, &ts->ts[0],
+		                               &send_ts) == 0) {
+			result->flags |= RESULT_PAYLOAD_SEND_TIME;
+		} else {
+			return -1;
+		}
+
+		/*
+		 * Error if timeout was already reached.
+		 * TODO: log it
+		 */
+		time_diff(&diff, &ts->ts[0], &send_ts);
+		if (time_is_greater(&diff, &r->max_latency))
+			return -1;
 
 #ifdef WRITE_IN_SENDER
-	send_info->recv_ts = ts->ts[0];
+		send_info->recv_ts = ts->ts[0];
+		send_info->rx_wakeup_ns = wakeup_ns;
+		send_info->mirror_rx_ns =
+		  len >= sizeof(*probe) ? probe->mirror_rx_ns : 0;
+		send_info->mirror_tx_ns =
+		  len >= sizeof(*probe) ? probe->mirror_tx_ns : 0;
 #endif
+
 	/* set received flag */
-	send_info->flags |= PACKET_RECEIVED;
+	} while (!sent_packet_set_flags(send_info, &state, PACKET_RECEIVED));
 
-	/* NOTE: exit critical region */
-	pthread_mutex_unlock(&r->send_history->mtx);
+	/* sw_ts is valid only if its flag was in the state we checked */
+	if (r->tx_stages && !(result->flags & RESULT_PAYLOAD_SEND_TIME)) {
+		result_set_tx_stages(result, &userspace_ts, &send_ts,
+		                     sent_packet_flags(state) &
+		                     PACKET_TX_SOFTWARE ? &sw_ts : NULL);
+	}
 
+_go_valid:
 	r->valid_packets++;
 
 	/*
 	 * nsec_sum is used later to calculate the round
-	 * trip latency average in nanoseconds (ns)
+	 * trip latency average in nanoseconds (ns), and
+	 * the histogram its percentiles
 	 */
-	r->nsec_sum += diff.tv_sec * 1000000000 + diff.tv_nsec;
+	nsec = diff.tv_sec * 1000000000 + diff.tv_nsec;
+	r->nsec_sum += nsec;
+	histogram_record(&r->histogram, nsec);
+
+	if (user_ts != NULL) {
+		histogram_record(&r->wakeup_latency, wakeup_ns);
+		result->rx_wakeup_ns = wakeup_ns;
+		result->flags |= RESULT_RX_WAKEUP;
+	}
+
+	result->id = id;
+	result->diff = diff;
+	result->send_ts = send_ts;
+	result->recv_ts = ts->ts[0];
 
-#ifndef WRITE_IN_SENDER
 	/*
-	 * send the result to the writer
-	 *
-	 * Fatal error when a broken partial transfer
-	 * happened. See result_buffer_insert_entry() in
-	 * result_buffer.h
+	 * the reply of an extended probe carries the
+	 * mirror timestamps (see probe.h)
 	 */
-	tmp_result.id = copy.id;
-	tmp_result.diff = diff;
-	if (result_buffer_insert_entry(r->result_buffer, &tmp_result) == -1)
-		return -EFATAL;
-#endif
+	if (len >= sizeof(*probe)) {
+		result_set_components(result, &send_ts, &ts->ts[0],
+		                      probe->mirror_rx_ns,
+		                      probe->mirror_tx_ns);
+	}
 
 	return 0;
-
-_go_unlock_mutex_and_drop_packet:
-	pthread_mutex_unlock(&r->send_history->mtx);
-_go_drop_packet:
-	return -1;
 }
 
 int
 receiver_do_its_job(struct receiver *r)
 {
+	struct mmsgctx *m = &r->mctx;
+	struct result results[RECEIVER_BATCH_SIZE];
+	struct timespec user_ts;
+	int valid;
+	int count;
+	int i;
+
 	/* process all packets we can read */
-	while (msgctx_recv(r->sfd, &r->mctx, 0) == 0) {
-		if (process_packet(r, &r->mctx) == -EFATAL)
-			return -1;
+	while ((count = mmsgctx_recv(r->sfd, m, 0)) > 0) {
+		valid = 0;
+
+		/* when the packets reached us, once per batch */
+		if (r->rx_wakeup)
+			clock_gettime(CLOCK_REALTIME, &user_ts);
+
+		for (i = 0; i < count; i++) {
+			if (process_packet(r, mmsgctx_msg(m, i),
+			    mmsgctx_data(m, i), mmsgctx_len(m, i),
+			    r->rx_wakeup ? &user_ts : NULL,
+			    &results[valid]) == 0)
+				valid++;
+		}
+
+#ifndef WRITE_IN_SENDER
+		/*
+		 * send the results to the writer
+		 *
+		 * Fatal error when a broken partial transfer
+		 * happened. See result_buffer_insert_entry() in
+		 * result_buffer.h
+		 */
+		for (i = 0; i < valid; i++) {
+			if (result_buffer_insert_entry(r->result_buffer,
+			    &results[i]) == -1)
+				return -1;
+		}
+#endif
 	}
 
 	return 0;
 }
 
+/*
+ * Process one packet read by the caller (see
+ * io_uring_run.c) and send its result to the writer.
+ * Invalid packets are just dropped.
+ */
+int
+receiver_process_msg(struct receiver *r, struct msghdr *msg, void *data,
+                     size_t len, struct timespec *user_ts)
+{
+	struct result result;
+
+	if (process_packet(r, msg, data, len, user_ts, &result) == -1)
+		return 0;
+
+#ifndef WRITE_IN_SENDER
+	/* see receiver_do_its_job() */
+	if (result_buffer_insert_entry(r->result_buffer, &result) == -1)
+		return -1;
+#endif
+
+	return 0;
+}
+
 void
 receiver_cleanup(struct receiver *r)
 {
-	msgctx_destroy(&r->mctx);
+	mmsgctx_destroy(&r->mctx);
 }
 
 int
-receiver_setup(struct receiver *r, unsigned int max_latency_ms)
+receiver_setup(struct receiver *r, uint64_t max_latency_ns)
 {
-	milliseconds_to_timespec(&r->max_latency, max_latency_ms);
+	nanoseconds_to_timespec(&r->max_latency, max_latency_ns);
 
 	/* nsec_sum is used to calculate the average later */
 	r->nsec_sum = 0;
 	r->valid_packets = 0;
 	r->duplicate_packets = 0;
+	histogram_reset(&r->histogram);
+	histogram_reset(&r->wakeup_latency);
 
 	/* initialize buffer where we receive mirror reply */
-	return msgctx_init(&r->mctx, 1500 /* MTU */, 1024,
-	                   sizeof(struct sockaddr_in));
+	return mmsgctx_init(&r->mctx, RECEIVER_BATCH_SIZE, 1500 /* MTU */,
+	                    1024, sizeof(struct sockaddr_in));
 }
@@ -22,7 +22,9 @@
 #include <stdint.h> /* uint64_t */
 #include <time.h>
 
+#include "histogram.h"
 #include "msgctx.h"
+#include "probe.h"
 #include "result_buffer.h"
 #include "send_history.h"
 
@@ -31,23 +33,44 @@ struct receiver {
 	struct result_buffer *result_buffer;
 	struct send_history *send_history;
 	int sfd;
+	/* SEND_TIME_* from probe.h */
+	int send_time;
+	/* TX stages, see sender.h (boolean) */
+	int tx_stages;
+	/* measure the RX wake-up latency (boolean) */
+	int rx_wakeup;
+	/* duplicates are results too, see RESULT_DUPLICATE (boolean) */
+	int report_duplicates;
 
 	struct timespec max_latency;
-	struct msgctx mctx;
+	/* packets received at once */
+	struct mmsgctx mctx;
 
 	/* log */
 	uint64_t nsec_sum;
 	uint64_t valid_packets;
 	uint64_t duplicate_packets;
+
+	/* round trip latencies, in nanoseconds */
+	struct histogram histogram;
+	/*
+	 * RX wake-up latency: from the kernel receive
+	 * timestamp until recvmmsg() returned (ns)
+	 */
+	struct histogram wakeup_latency;
 };
 
 int
 receiver_do_its_job(struct receiver *r);
 
+int
+receiver_process_msg(struct receiver *r, struct msghdr *msg, void *data,
+                     size_t len, struct timespec *user_ts);
+
 void
 receiver_cleanup(struct receiver *r);
 
 int
-receiver_setup(struct receiver *r, unsigned int max_latency_ms);
+receiver_setup(struct receiver *r, uint64_t max_latency_ns);
 
 #endif /* RECEIVER_H */
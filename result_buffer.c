@@ -20,53 +20,47 @@
  * 20/05/2018
  *
  * do some buffering and send results to the writer
+ *
+ * The results are handed to the writer through a ring in
+ * memory, see struct result_buffer.
  */
 
-#include <errno.h> /* EAGAIN */
-#include <unistd.h> /* write() */
+#include <sys/eventfd.h> /* eventfd_write() */
 
 #include "result_buffer.h"
 
+/*
+ * make the entries written so far visible to the writer
+ * and wake it up if it's sleeping
+ *
+ * The store of published_tail and the load of
+ * consumer_sleeping are ordered against their counterparts
+ * in result_buffer_consumer_sleep(), so either we see the
+ * writer sleeping or it sees the new entries.
+ */
 static int
-transfer_to_writer(struct result_buffer *b, unsigned int size)
+transfer_to_writer(struct result_buffer *b)
 {
-	int written;
-
-	/* write to the writer's pipe */
-	written = write(b->writefd, b->buffer, size);
-	if (written != size) {
-		if (written == -1) {
-			/* something went wrong */
-			if (errno == EAGAIN) {
-				/* buffer is full */
-				b->misses++;
-				return 0;
-			}
-			return -1;
-		} else if (written % sizeof(*b->buffer) != 0) {
-			/*
-			 * there was a partial write
-			 * resulting in a broken result
-			 * structure
-			 */
+	__atomic_store_n(&b->published_tail, b->tail, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&b->consumer_sleeping, __ATOMIC_SEQ_CST)
+	    && __atomic_exchange_n(&b->consumer_sleeping, 0,
+	                           __ATOMIC_SEQ_CST)) {
+		if (eventfd_write(b->efd, 1) == -1)
 			return -1;
-		}
 	}
 
 	return 0;
-	
 }
 
 #ifdef WRITE_IN_SENDER
 int
 result_buffer_transfer(struct result_buffer *b)
 {
-	int size = b->index * sizeof(*b->buffer);
-
-	if (size == 0)
+	if (b->tail == b->published_tail)
 		return 0;
 
-	return transfer_to_writer(b, size);
+	return transfer_to_writer(b);
 }
 #endif
 
@@ -79,20 +73,72 @@ int
 result_buffer_insert_entry(struct result_buffer *b, struct result *result)
 {
 	/*
-	 * if local buffer is not full, just insert one
-	 * more entry and return
+	 * if the ring is full, check whether the writer
+	 * has made room. Otherwise, drop the entry.
 	 */
-	b->buffer[b->index] = *result;
-	b->index++;
-	if (b->index != b->boundary)
+	if (b->tail - b->head_cache == b->size) {
+		b->head_cache = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+		if (b->tail - b->head_cache == b->size) {
+			b->misses++;
+			return 0;
+		}
+	}
+
+	/*
+	 * insert one more entry and return if we haven't
+	 * buffered enough
+	 */
+	b->buffer[b->tail & b->mask] = *result;
+	b->tail++;
+	if (b->tail - b->published_tail < b->boundary)
 		return 0;
 
 	/*
-	 * the buffer is full, let's transfer it to the
+	 * enough entries, let's transfer them to the
 	 * writer
 	 */
+	return transfer_to_writer(b);
+}
 
-	b->index = 0;
+/*
+ * Point `entries` to the published results not consumed
+ * yet and return how many they are. Only the entries up to
+ * the end of the ring are returned.
+ */
+unsigned int
+result_buffer_peek(struct result_buffer *b, struct result **entries)
+{
+	uint64_t tail = __atomic_load_n(&b->published_tail, __ATOMIC_ACQUIRE);
+	unsigned int index = b->head & b->mask;
+
+	*entries = &b->buffer[index];
+
+	if (tail - b->head > b->size - index)
+		return b->size - index;
+
+	return tail - b->head;
+}
+
+/* give `count` entries back to the producer */
+void
+result_buffer_consume(struct result_buffer *b, unsigned int count)
+{
+	__atomic_store_n(&b->head, b->head + count, __ATOMIC_RELEASE);
+}
 
-	return transfer_to_writer(b, b->size);
+/*
+ * Tell the producer we're going to sleep, so it rings the
+ * doorbell on its next transfer. Return zero (and stay
+ * awake) if results were published meanwhile.
+ */
+int
+result_buffer_consumer_sleep(struct result_buffer *b)
+{
+	__atomic_store_n(&b->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&b->published_tail, __ATOMIC_SEQ_CST) == b->head)
+		return 1;
+
+	__atomic_store_n(&b->consumer_sleeping, 0, __ATOMIC_SEQ_CST);
+	return 0;
 }
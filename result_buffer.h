@@ -30,25 +30,161 @@
 struct result {
 	uint64_t id;
 	struct timespec diff;
-	/* timestamp when packet was sent */
-	//struct timespec sendts;
-	/* timestamp when packet was received */
-	//struct timespec recvts;
+	/*
+	 * when the packet was sent (the send time the round
+	 * trip is measured from) and received, zero if unknown
+	 */
+	struct timespec send_ts;
+	struct timespec recv_ts;
+
+	/* RESULT_* below */
+	unsigned int flags;
+
+	/*
+	 * round trip split by the mirror timestamps, in
+	 * nanoseconds. Valid with RESULT_MIRROR_TIMESTAMPS.
+	 *
+	 * forward and reverse are only meaningful if the
+	 * clocks of both hosts are synchronized, and may be
+	 * negative otherwise.
+	 */
+	int64_t forward_ns;
+	int64_t residence_ns;
+	int64_t reverse_ns;
+
+	/*
+	 * host side of the send, in nanoseconds: from the
+	 * send call to the qdisc (TX_SCHED) and from the qdisc
+	 * to the driver (TX_SOFTWARE). Valid with
+	 * RESULT_TX_SCHED_DELAY and RESULT_TX_QUEUE_DELAY.
+	 */
+	int64_t sched_delay_ns;
+	int64_t queue_delay_ns;
+
+	/*
+	 * from the kernel receive timestamp until the receiver
+	 * read the packet, in nanoseconds. Valid with
+	 * RESULT_RX_WAKEUP.
+	 */
+	int64_t rx_wakeup_ns;
 };
 
+/*
+ * values in flags, written as they are in the binary v2
+ * records (WRITER_RECORD_* in writer_format.h)
+ */
+
+/* the mirror filled its timestamps in the probe */
+#define RESULT_MIRROR_TIMESTAMPS  (1 << 0)
+/* the send time is the sender clock, not a kernel timestamp */
+#define RESULT_PAYLOAD_SEND_TIME  (1 << 1)
+/* sched_delay_ns and queue_delay_ns */
+#define RESULT_TX_SCHED_DELAY     (1 << 2)
+#define RESULT_TX_QUEUE_DELAY     (1 << 3)
+/* rx_wakeup_ns */
+#define RESULT_RX_WAKEUP          (1 << 4)
+/* sent late (PACKET_LATE) */
+#define RESULT_LATE               (1 << 5)
+/* never received, no round trip */
+#define RESULT_LOST               (1 << 6)
+/* already received, no round trip */
+#define RESULT_DUPLICATE          (1 << 7)
+
+/*
+ * Fill the components of the round trip from the send and
+ * receive timestamps of the measurer and the receive and
+ * send times of the mirror (see probe.h). A zero mirror
+ * time means the mirror didn't fill it.
+ */
+static inline void
+result_set_components(struct result *r, struct timespec *send_ts,
+                      struct timespec *recv_ts, uint64_t mirror_rx_ns,
+                      uint64_t mirror_tx_ns)
+{
+	int64_t send_ns;
+	int64_t recv_ns;
+
+	if (!mirror_rx_ns || !mirror_tx_ns)
+		return;
+
+	send_ns = send_ts->tv_sec * 1000000000LL + send_ts->tv_nsec;
+	recv_ns = recv_ts->tv_sec * 1000000000LL + recv_ts->tv_nsec;
+
+	r->forward_ns = (int64_t) mirror_rx_ns - send_ns;
+	r->residence_ns = (int64_t) (mirror_tx_ns - mirror_rx_ns);
+	r->reverse_ns = recv_ns - (int64_t) mirror_tx_ns;
+	r->flags |= RESULT_MIRROR_TIMESTAMPS;
+}
+
+static inline int64_t
+result_timespec_diff_ns(struct timespec *stop, struct timespec *start)
+{
+	return (stop->tv_sec - start->tv_sec) * 1000000000LL +
+	       (stop->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Fill the host side stages of the send from the userspace
+ * time before the send call and the TX_SCHED and
+ * TX_SOFTWARE kernel timestamps. NULL means unknown.
+ */
+static inline void
+result_set_tx_stages(struct result *r, struct timespec *userspace_ts,
+                     struct timespec *sched_ts, struct timespec *sw_ts)
+{
+	if (userspace_ts != NULL) {
+		r->sched_delay_ns = result_timespec_diff_ns(sched_ts,
+		                                            userspace_ts);
+		r->flags |= RESULT_TX_SCHED_DELAY;
+	}
+
+	if (sw_ts != NULL) {
+		r->queue_delay_ns = result_timespec_diff_ns(sw_ts, sched_ts);
+		r->flags |= RESULT_TX_QUEUE_DELAY;
+	}
+}
+
+/*
+ * single producer, single consumer ring shared with the
+ * writer thread
+ *
+ * The producer (receiver, or sender if WRITE_IN_SENDER)
+ * writes results in place and publishes them every
+ * `boundary` entries. The consumer (writer) is woken up
+ * through `efd` only when it has said it's going to sleep.
+ *
+ * Producer and consumer fields are kept in separate cache
+ * lines.
+ */
+#define RESULT_BUFFER_ALIGNMENT  __attribute__((aligned(64)))
+
+/* minimum number of entries of the ring */
+#define RESULT_BUFFER_MIN_SIZE  65536
+
 struct result_buffer {
-	/* used for buffering results */
+	/* the ring (size is a power of two) */
 	struct result *buffer;
 	unsigned int   size;
+	unsigned int   mask;
+	/* number of entries to buffer before publishing */
 	unsigned int   boundary;
-	unsigned int   index;
 
-	/* log */
-	unsigned int   misses;
+	/* eventfd used to wake up the writer */
+	int efd;
 
-	/* pipe ends file descriptors */
-	int readfd;
-	int writefd;
+	/* producer: next entry to write and last seen head */
+	uint64_t tail RESULT_BUFFER_ALIGNMENT;
+	uint64_t head_cache;
+
+	/* log: entries that couldn't be transferred to the writer */
+	unsigned int misses;
+
+	/* shared: written by producer */
+	uint64_t published_tail RESULT_BUFFER_ALIGNMENT;
+
+	/* shared: written by consumer */
+	uint64_t head RESULT_BUFFER_ALIGNMENT;
+	int consumer_sleeping;
 };
 
 #ifdef WRITE_IN_SENDER
@@ -59,4 +195,15 @@ result_buffer_transfer(struct result_buffer *b);
 int
 result_buffer_insert_entry(struct result_buffer *b, struct result *result);
 
+/* consumer side */
+
+unsigned int
+result_buffer_peek(struct result_buffer *b, struct result **entries);
+
+void
+result_buffer_consume(struct result_buffer *b, unsigned int count);
+
+int
+result_buffer_consumer_sleep(struct result_buffer *b);
+
 #endif /* RESULT_BUFFER_H */
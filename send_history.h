@@ -24,13 +24,19 @@
  * if a new entry is request and the buffer is full, the
  * timeout of the oldest (next) entry has elapsed and we
  * can overwrite it. See setup_send_history() in main.c
+ *
+ * There is no lock. The id and the flags of an entry share
+ * a single word (`state`) which is updated atomically. The
+ * sender publishes a new id with an exchange, and the storer
+ * and receiver set their flags with a compare-and-swap that
+ * fails if the entry has been overwritten in the meantime.
  */
 
 #ifndef SEND_HISTORY_H
 #define SEND_HISTORY_H
 
 #include <stdint.h> /* uint64_t */
-#include <pthread.h> /* pthread_mutex_t */
+#include <time.h> /* struct timespec */
 
 /*
  * single ring buffer
@@ -70,20 +76,67 @@ single_ring_buffer_update(struct single_ring_buffer *b)
 	}
 }
 
+/*
+ * step back `n` entries (n <= size), undoing the last `n`
+ * updates. is_full is kept as is.
+ */
+static inline void
+single_ring_buffer_rewind(struct single_ring_buffer *b, unsigned int n)
+{
+	if (b->current < n)
+		b->current += b->size;
+	b->current -= n;
+}
+
 /* ---------------------------------------- */
 
-struct sent_packet {
-	uint64_t id;
-	uint64_t flags;
+/*
+ * With SEND_HISTORY_ALIGNED, every entry takes a whole
+ * cache line. In multi thread mode the sender, storer and
+ * receiver write to adjacent entries from different cores,
+ * which otherwise share cache lines (false sharing).
+ */
+#define CACHE_LINE_SIZE  64
+
+#ifdef SEND_HISTORY_ALIGNED
+#define SENT_PACKET_ALIGNMENT  __attribute__((aligned(CACHE_LINE_SIZE)))
+#else
+#define SENT_PACKET_ALIGNMENT
+#endif
 
-	/* userspace timestamp at the time of send() call */
+struct sent_packet {
+	/*
+	 * id (lower 40 bits) and flags (upper 24 bits)
+	 * Use the sent_packet_*() helpers below to access it.
+	 */
+	uint64_t state;
+
+	/*
+	 * userspace timestamp at the time of send() call
+	 * (CLOCK_REALTIME). Only written with TX stages (see
+	 * sender.h), before the packet is sent.
+	 */
 	struct timespec userspace_ts;
-	/* kernel timestamp when packet was sent */
+	/*
+	 * kernel timestamp when packet was sent
+	 * Written by the storer before PACKET_TIMESTAMPED is set.
+	 */
 	struct timespec ts;
+	/*
+	 * kernel timestamp when packet was handed to the driver
+	 * (TX_SOFTWARE), written before PACKET_TX_SOFTWARE is set
+	 */
+	struct timespec sw_ts;
 #ifdef WRITE_IN_SENDER
+	/* written by the receiver before PACKET_RECEIVED is set */
 	struct timespec recv_ts;
+	/* mirror timestamps from the reply, zero if absent */
+	uint64_t mirror_rx_ns;
+	uint64_t mirror_tx_ns;
+	/* RX wake-up latency, zero if not measured */
+	int64_t rx_wakeup_ns;
 #endif
-};
+} SENT_PACKET_ALIGNMENT;
 
 #define PACKET_ID_MASK  0x000000ffffffffff
 #define PACKET_ID_MAX   0x000000ffffffffff
@@ -92,10 +145,8 @@ struct sent_packet {
 struct send_history {
 	uint64_t packet_id_boundary;
 
-	/* controls access to send history */
-	pthread_mutex_t mtx;
-
 	struct sent_packet *buffer;
+	/* only used by the sender */
 	struct single_ring_buffer control;
 };
 
@@ -104,5 +155,56 @@ struct send_history {
 #define PACKET_SENT         (1 << 1)
 #define PACKET_TIMESTAMPED  (1 << 2)
 #define PACKET_RECEIVED     (1 << 3)
+/* sent after its deadline, catching up timer overruns */
+#define PACKET_LATE         (1 << 4)
+/* sw_ts has been stored */
+#define PACKET_TX_SOFTWARE  (1 << 5)
+
+#define PACKET_FLAGS_SHIFT  40
+
+#define sent_packet_id(state)     ((state) & PACKET_ID_MASK)
+#define sent_packet_flags(state)  ((state) >> PACKET_FLAGS_SHIFT)
+
+static inline uint64_t
+sent_packet_load(struct sent_packet *e)
+{
+	return __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Put a new id (flagged as sent, plus `flags`) in the entry
+ * and return the previous state.
+ */
+static inline uint64_t
+sent_packet_publish(struct sent_packet *e, uint64_t id, uint64_t flags)
+{
+	return __atomic_exchange_n(&e->state,
+	         id | ((PACKET_SENT | flags) << PACKET_FLAGS_SHIFT),
+	         __ATOMIC_ACQ_REL);
+}
+
+/* put back a state returned by sent_packet_publish() */
+static inline void
+sent_packet_restore(struct sent_packet *e, uint64_t state)
+{
+	__atomic_store_n(&e->state, state, __ATOMIC_RELEASE);
+}
+
+/*
+ * Add `flags` to the entry if its state is still `*state`.
+ * Return nonzero on success. Otherwise `*state` is updated
+ * with the current one, so the caller can check it again.
+ *
+ * Data written to the entry before a successful call is
+ * visible to whoever loads the new state.
+ */
+static inline int
+sent_packet_set_flags(struct sent_packet *e, uint64_t *state,
+                      uint64_t flags)
+{
+	return __atomic_compare_exchange_n(&e->state, state,
+	         *state | (flags << PACKET_FLAGS_SHIFT), 0,
+	         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
 
 #endif /* SEND_HISTORY_H */
@@ -28,44 +28,106 @@
  *
  * 17:21 23/10/2017: revised
  * 16:08 03/05/2018: revised
+ *
+ * The packets of every timer expiration are sent in a
+ * single burst using sendmmsg().
  */
 
+#define _GNU_SOURCE /* sendmmsg() */
+
 #include <netinet/in.h> /* struct sockaddr_in */
-#include <pthread.h> /* pthread_mutex_*() */
 #include <stdint.h> /* int*_t */
 #include <stdio.h> /* printf */
-#include <sys/socket.h> /* sendto() */
+#include <stdlib.h> /* posix_memalign() free() */
+#include <string.h> /* memset() */
+#include <sys/socket.h> /* sendmmsg() */
 #include <sys/timerfd.h> /* timerfd_*() */
+#include <time.h> /* clock_gettime() */
 #include <sys/types.h> /* send() */
 #include <unistd.h> /* close() read() */
 
 #include "sender.h"
 
+#include "histogram.h" /* histogram_record() */
 #include "send_history.h"
+#include "time_common.h" /* nanoseconds_to_timespec() */
 #ifdef WRITE_IN_SENDER
 #include "result_buffer.h"
-#include "time_common.h"
 #endif
 
 #ifdef WRITE_IN_SENDER
+/*
+ * TX stages and RX wake-up latency of a received entry
+ *
+ * rx_wakeup_ns is always copied, the writer only shows it
+ * if it has been measured.
+ */
+static void
+set_stages(struct sender *s, struct result *result,
+           struct sent_packet *entry, uint64_t state)
+{
+	result->rx_wakeup_ns = entry->rx_wakeup_ns;
+	result->flags |= RESULT_RX_WAKEUP;
+
+	if (!s->tx_stages)
+		return;
+
+	result_set_tx_stages(result, &entry->userspace_ts, &entry->ts,
+	                     sent_packet_flags(state) & PACKET_TX_SOFTWARE ?
+	                     &entry->sw_ts : NULL);
+}
+
+/*
+ * Send and receive times of an entry, zero if unknown, and
+ * whether it was sent late or lost
+ */
+static void
+set_times(struct result *result, struct sent_packet *entry, uint64_t state)
+{
+	int flags = sent_packet_flags(state);
+
+	result->send_ts.tv_sec = 0;
+	result->send_ts.tv_nsec = 0;
+	result->recv_ts = result->send_ts;
+
+	if (flags & PACKET_TIMESTAMPED)
+		result->send_ts = entry->ts;
+	if (flags & PACKET_RECEIVED)
+		result->recv_ts = entry->recv_ts;
+	else
+		result->flags |= RESULT_LOST;
+
+	if (flags & PACKET_LATE)
+		result->flags |= RESULT_LATE;
+}
+
 int
 sender_flush_send_history(struct sender *s)
 {
 	struct sent_packet *entry;
 	struct timespec     diff;
 	struct result tmp_result;
+	uint64_t state;
 	int i;
 
 	i = s->send_history->control.current;
 
 	do {
 		entry = &s->send_history->buffer[i];
+		state = sent_packet_load(entry);
 
-		if (entry->flags & PACKET_TIMESTAMPED
-		    && entry->flags & PACKET_RECEIVED) {
+		if (sent_packet_flags(state) & PACKET_TIMESTAMPED
+		    && sent_packet_flags(state) & PACKET_RECEIVED) {
 			time_diff(&diff, &entry->recv_ts, &entry->ts);
-			tmp_result.id = entry->id;
+			tmp_result.id = sent_packet_id(state);
 			tmp_result.diff = diff;
+			tmp_result.flags = 0;
+			set_times(&tmp_result, entry, state);
+			result_set_components(&tmp_result, &entry->ts,
+			                      &entry->recv_ts,
+			                      entry->mirror_rx_ns,
+			                      entry->mirror_tx_ns);
+			set_stages(s, &tmp_result, entry, state);
 			if (result_buffer_insert_entry(s->result_buffer,
 			    &tmp_result) == -1)
 				return -1;
@@ -87,12 +149,11 @@ sender_flush_send_history(struct sender *s)
 
 #ifdef SEND_COUNT
 static void
-set_timer(struct sender *s, unsigned int ms)
+set_timer(struct sender *s, uint64_t ns)
 {
 	struct itimerspec interval;
 
-	interval.it_value.tv_sec = (ms / 1000);
-	interval.it_value.tv_nsec = (ms % 1000) * 1000000;
+	nanoseconds_to_timespec(&interval.it_value, ns);
 	interval.it_interval.tv_sec = 0;
 	interval.it_interval.tv_nsec = 0;
 
@@ -100,140 +161,506 @@ set_timer(struct sender *s, unsigned int ms)
 }
 #endif
 
-int
-sender_do_its_job(struct sender *s)
+/*
+ * Reserve `count` entries of send history for the burst.
+ *
+ * All IDs are put in ring buffer before send. If we put
+ * the ids after send, the storer may wake up before we put
+ * them and then see inconsistent data. The overwritten
+ * entries are kept, so they can be restored if the packets
+ * are not sent.
+ *
+ * Once the new id is published, neither the storer nor the
+ * receiver write to the entry on behalf of the old id, so
+ * it's safe to copy its timestamps afterwards.
+ */
+static void
+reserve_entries(struct sender *s, unsigned int count, uint64_t flags)
+{
+	struct sent_packet *entry;
+	uint64_t id = s->current_id;
+	uint64_t state;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		entry =
+		&s->send_history->buffer[s->send_history->control.current];
+
+		state = sent_packet_publish(entry, id, flags);
+		s->overwritten[i] = *entry;
+		s->overwritten[i].state = state;
+
+		single_ring_buffer_update(&s->send_history->control);
+
+		/* flags go in 0xffffff0000000000 */
+		s->probes[i].header = (id & PACKET_ID_MASK)
+		                      | flags << PACKET_FLAGS_SHIFT;
+
+		if (++id == s->send_history->packet_id_boundary)
+			id = 0;
+	}
+}
+
+/*
+ * Stateless mode (SEND_TIME_PAYLOAD): just number the
+ * probes, the send history is not used.
+ */
+static void
+number_probes(struct sender *s, unsigned int count, uint64_t flags)
+{
+	uint64_t id = s->current_id;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		s->probes[i].header = (id & PACKET_ID_MASK)
+		                      | flags << PACKET_FLAGS_SHIFT;
+
+		if (++id == s->send_history->packet_id_boundary)
+			id = 0;
+	}
+}
+
+/*
+ * Take the send time of packets `from` to `from + n` of a
+ * burst of `count`, right before they are sent, and put it
+ * in the probes (see SEND_TIME_* in probe.h) and, with TX
+ * stages, in the reserved entries.
+ *
+ * The entries are already published, but the storer only
+ * reads userspace_ts once the packet has been sent, so the
+ * send call orders the write before it.
+ */
+static void
+stamp_packets(struct sender *s, unsigned int count, unsigned int from,
+              unsigned int n, struct timespec *now)
+{
+	struct send_history *h = s->send_history;
+	uint64_t send_ns;
+	unsigned int first;
+	unsigned int i;
+
+	clock_gettime(CLOCK_REALTIME, now);
+	send_ns = timespec_to_nanoseconds(now);
+
+	if (s->send_time != SEND_TIME_HISTORY) {
+		for (i = from; i < from + n; i++)
+			s->probes[i].send_ns = send_ns;
+	}
+
+	if (s->tx_stages) {
+		first = h->control.current + h->control.size - count;
+		for (i = from; i < from + n; i++)
+			h->buffer[(first + i) % h->control.size].userspace_ts =
+			  *now;
+	}
+}
+
+/*
+ * Give back the last `count` reserved entries, whose
+ * packets were not sent, restoring their previous content.
+ * The next ID will be the one of the first unsent packet.
+ */
+static void
+release_entries(struct sender *s, unsigned int sent, unsigned int count)
+{
+	struct send_history *h = s->send_history;
+	struct sent_packet *entry;
+	struct sent_packet *old;
+	unsigned int i;
+
+	single_ring_buffer_rewind(&h->control, count - sent);
+
+	for (i = sent; i < count; i++) {
+		entry =
+		&h->buffer[(h->control.current + i - sent) % h->control.size];
+		old = &s->overwritten[i];
+
+		/* the state goes last, publishing the data */
+		entry->userspace_ts = old->userspace_ts;
+		entry->ts = old->ts;
+		entry->sw_ts = old->sw_ts;
+#ifdef WRITE_IN_SENDER
+		entry->recv_ts = old->recv_ts;
+		entry->mirror_rx_ns = old->mirror_rx_ns;
+		entry->mirror_tx_ns = old->mirror_tx_ns;
+		entry->rx_wakeup_ns = old->rx_wakeup_ns;
+#endif
+		sent_packet_restore(entry, old->state);
+	}
+}
+
+/*
+ * Send the burst. sendmmsg() may send less than asked
+ * (e.g. vlen is capped at UIO_MAXIOV), so call it again
+ * for the remaining messages until one call fails.
+ *
+ * Return the number of packets sent.
+ */
+static unsigned int
+send_burst(struct sender *s, unsigned int count)
+{
+	unsigned int sent = 0;
+	int tmp;
+
+	while (sent < count) {
+		tmp = sendmmsg(s->sfd, &s->msgs[sent], count - sent, 0);
+		if (tmp <= 0)
+			break;
+		sent += tmp;
+	}
+
+	return sent;
+}
+
+/*
+ * TX stages: send the packets one by one, each stamped
+ * right before its own send call, so the time from the
+ * send call to the qdisc of a packet doesn't include the
+ * packets sent before it. `start` is when it began.
+ *
+ * Return the number of packets sent.
+ */
+static unsigned int
+send_stamped(struct sender *s, unsigned int count, struct timespec *start)
+{
+	struct timespec now;
+	unsigned int sent;
+
+	clock_gettime(CLOCK_REALTIME, start);
+
+	for (sent = 0; sent < count; sent++) {
+		stamp_packets(s, count, sent, 1, &now);
+		if (sendmmsg(s->sfd, &s->msgs[sent], 1, 0) != 1)
+			break;
+	}
+
+	return sent;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_nanoseconds(&now);
+}
+
+/*
+ * Wait for the deadline of the burst. With precise pacing
+ * the timer woke us up spin_ns earlier, so busy-wait on
+ * the clock. Return the current time.
+ *
+ * Precise pacing is meant for a dedicated (pinned) core,
+ * the spinning holds the thread.
+ */
+static uint64_t
+wait_for_deadline(struct sender *s)
+{
+	uint64_t now = now_ns();
+
+	if (s->spin_ns) {
+		while (now < s->next_deadline)
+			now = now_ns();
+	}
+
+	return now;
+}
+
+/*
+ * Send one burst of packet_count packets, with
+ * `packet_flags` (besides PACKET_SENT) in their header and
+ * send history entries.
+ */
+static int
+do_burst(struct sender *s, uint64_t packet_flags)
 {
 	/* temporary */
-	int i;
+	unsigned int count;
+	unsigned int sent;
 	int tmp;
-	uint64_t timer_overruns;
-	uint64_t packet_header;
-	struct sent_packet *entry;
+	unsigned int i;
+	struct timespec before;
+	struct timespec after;
 
 #ifdef WRITE_IN_SENDER
 	/* used for writing results */
-	struct sent_packet  copy;
+	struct sent_packet *copy;
 	struct timespec     diff;
 	struct result       tmp_result;
 #endif
 
-	/* get timer overrun counter */
-	tmp = read(s->tfd, &timer_overruns, sizeof(timer_overruns));
-	if (tmp != sizeof(timer_overruns))
-		return 0;
-	if (timer_overruns == 0) {
-		return 0;
-	} else if (timer_overruns > 1) {
-		printf("oops, multiple timer overruns (overruns: %ld)",
-		       timer_overruns);
-		return -1; /* exit ERROR */
-	}
-
+	count = s->packet_count;
 #ifdef SEND_COUNT
-	/* TODO: make it return an OK status */
-	if (s->exit_sender)
-		return -1;
+	/* do not send more than the user asked for */
+	if (s->send_count != -1
+	    && s->send_count - s->total_packets_sent < count)
+		count = s->send_count - s->total_packets_sent;
 #endif
 
-	/* send packets */
-	for (i = 0; i < s->packet_count; i++) {
-		packet_header = s->current_id & PACKET_ID_MASK;
-		/* NOTE: set flags (0xffffff0000000000) here */
-
-		/*
-		 * Put the id in ring buffer
-		 * before send. If we put the id
-		 * after send, the storer may wake
-		 * up before we put it and then
-		 * see inconsistent data.
-		 *
-		 * Timestamp messages may arrive out
-		 * of order in storer
-		 */
-
-		/* NOTE: enter critical region */
-		pthread_mutex_lock(&s->send_history->mtx);
+	if (s->send_time == SEND_TIME_PAYLOAD)
+		number_probes(s, count, packet_flags);
+	else
+		reserve_entries(s, count, packet_flags);
+
+	if (s->tx_stages) {
+		sent = send_stamped(s, count, &before);
+	} else {
+		if (s->send_time != SEND_TIME_HISTORY)
+			stamp_packets(s, count, 0, count, &before);
+		sent = send_burst(s, count);
+	}
 
-		entry =
-		&s->send_history->buffer[s->send_history->control.current];
+	/* how long the send calls take */
+	if (s->tx_stages) {
+		clock_gettime(CLOCK_REALTIME, &after);
+		histogram_record(&s->send_syscall,
+		                 timespec_to_nanoseconds(&after) -
+		                 timespec_to_nanoseconds(&before));
+	}
+
+	/*
+	 * keep the ring buffer and the ID consistent with
+	 * what has actually been sent
+	 */
+	if (sent != count && s->send_time != SEND_TIME_PAYLOAD)
+		release_entries(s, sent, count);
+
+	/* increment a counter of sent packets */
+	s->total_packets_sent += sent;
+	if (packet_flags & PACKET_LATE)
+		s->total_packets_late += sent;
+
+	s->current_id += sent;
+	if (s->current_id >= s->send_history->packet_id_boundary)
+		s->current_id -= s->send_history->packet_id_boundary;
+
+	/*
+	 * The overwritten entries have reached their
+	 * timeout. Count the ones never received.
+	 *
+	 * Without send history, losses are not tracked.
+	 */
+	for (i = 0; i < sent && s->send_time != SEND_TIME_PAYLOAD; i++) {
+		tmp = sent_packet_flags(s->overwritten[i].state);
+		if (tmp & PACKET_SENT && !(tmp & PACKET_RECEIVED))
+			s->total_packets_lost++;
+	}
 
 #ifdef WRITE_IN_SENDER
-		copy = *entry;
-#endif
+	for (i = 0; i < sent; i++) {
+		copy = &s->overwritten[i];
 
-		entry->id = s->current_id;
-		entry->flags = PACKET_SENT;
+		if (!(sent_packet_flags(copy->state) & PACKET_SENT))
+			continue;
 
-		single_ring_buffer_update(&s->send_history->control);
+		tmp_result.id = sent_packet_id(copy->state);
+		tmp_result.flags = 0;
+		set_times(&tmp_result, copy, copy->state);
 
-		/* NOTE: exit critical region */
-		pthread_mutex_unlock(&s->send_history->mtx);
+		if (sent_packet_flags(copy->state) & PACKET_TIMESTAMPED &&
+		    sent_packet_flags(copy->state) & PACKET_RECEIVED) {
+			time_diff(&diff, &copy->recv_ts, &copy->ts);
+			tmp_result.diff = diff;
+			result_set_components(&tmp_result, &copy->ts,
+			                      &copy->recv_ts,
+			                      copy->mirror_rx_ns,
+			                      copy->mirror_tx_ns);
+			set_stages(s, &tmp_result, copy, copy->state);
+		} else {
+			tmp_result.diff.tv_sec = 0;
+			tmp_result.diff.tv_nsec = 0;
+		}
 
-		/* if send fails we quit the program */
-		tmp = sendto(s->sfd, &packet_header,
-			     sizeof(packet_header), 0,
-			     (struct sockaddr*) &s->addr, sizeof(s->addr));
-		if (tmp != sizeof(packet_header))
+		if (result_buffer_insert_entry(s->result_buffer,
+		    &tmp_result) == -1)
 			return -1;
+	}
+#endif
 
-		/* increment a counter of sent packets */
-		s->total_packets_sent++;
+	/* if send fails we quit the program */
+	if (sent != count)
+		return -1;
 
-		if (++s->current_id == s->send_history->packet_id_boundary)
-			s->current_id = 0;
+#ifdef SEND_COUNT
+	if (s->send_count != -1
+	    && s->total_packets_sent == s->send_count) {
+		set_timer(s, s->max_latency_ns);
+		s->exit_sender = 1;
+	}
+#endif
 
-#ifdef WRITE_IN_SENDER
-		if (copy.flags & PACKET_SENT) {
-			tmp_result.id = copy.id;
-
-			if (copy.flags & PACKET_TIMESTAMPED &&
-			    copy.flags & PACKET_RECEIVED) {
-				time_diff(&diff, &copy.recv_ts, &copy.ts);
-				tmp_result.diff = diff;
-			} else {
-				tmp_result.diff.tv_sec = 0;
-				tmp_result.diff.tv_nsec = 0;
-			}
+	return 0;
+}
 
-			if (result_buffer_insert_entry(s->result_buffer,
-			    &tmp_result) == -1)
-				return -1;
-		}
-#endif
+/* account `count` bursts that won't be sent */
+static void
+skip_bursts(struct sender *s, uint64_t count)
+{
+	s->skipped_bursts += count;
+	s->next_deadline += count * s->interval_ns;
+}
+
+int
+sender_do_its_job(struct sender *s)
+{
+	/* temporary */
+	int tmp;
+	uint64_t timer_overruns;
+	uint64_t bursts;
+	uint64_t max_bursts;
+	uint64_t now;
+
+	/* get timer overrun counter */
+	tmp = read(s->tfd, &timer_overruns, sizeof(timer_overruns));
+	if (tmp != sizeof(timer_overruns))
+		return 0;
+	if (timer_overruns == 0)
+		return 0;
 
 #ifdef SEND_COUNT
-		if (s->send_count != -1
-		    && s->total_packets_sent == s->send_count) {
-			set_timer(s, s->max_latency);
-			s->exit_sender = 1;
-			return 0;
-		}
+	/* TODO: make it return an OK status */
+	if (s->exit_sender)
+		return -1;
 #endif
 
+	/*
+	 * More than one expiration means we have missed
+	 * the deadline of some bursts.
+	 */
+	bursts = 1;
+	if (timer_overruns > 1) {
+		s->timer_overruns += timer_overruns - 1;
+
+		switch (s->overrun_policy) {
+		case SENDER_OVERRUN_SKIP:
+			/* don't send the missed bursts, just account */
+			skip_bursts(s, timer_overruns - 1);
+			break;
+		case SENDER_OVERRUN_LATE:
+			/*
+			 * send all of them now, tagged as late
+			 *
+			 * More bursts than the send history holds
+			 * would overwrite each other, skip them.
+			 */
+			bursts = timer_overruns;
+			max_bursts = s->send_history->control.size /
+			             s->packet_count;
+			if (bursts > max_bursts) {
+				skip_bursts(s, bursts - max_bursts);
+				bursts = max_bursts;
+			}
+			break;
+		case SENDER_OVERRUN_ABORT:
+		default:
+			printf("oops, multiple timer overruns (overruns: %ld)",
+			       timer_overruns);
+			return -1; /* exit ERROR */
+		}
+	}
+
+	while (bursts--) {
+		/* record how late we are, then schedule the next burst */
+		now = wait_for_deadline(s);
+		histogram_record(&s->departure_error,
+		                 now > s->next_deadline ?
+		                 now - s->next_deadline : 0);
+		s->next_deadline += s->interval_ns;
+
+		/* all but the burst of the current expiration are late */
+		if (do_burst(s, bursts ? PACKET_LATE : 0) == -1)
+			return -1;
+
+#ifdef SEND_COUNT
+		if (s->exit_sender)
+			break;
+#endif
 	}
 
 	return 0;
 }
 
+/*
+ * The timer is absolute, so the expirations keep in step
+ * with the deadlines (with precise pacing, spin_ns ahead).
+ */
 void
 sender_timer_start(struct sender *s)
 {
 	struct itimerspec interval;
 
-	interval.it_value = s->sleep_interval;
+	s->next_deadline = now_ns() + s->interval_ns;
+
+	nanoseconds_to_timespec(&interval.it_value,
+	                        s->next_deadline - s->spin_ns);
 	interval.it_interval = s->sleep_interval;
 
-	timerfd_settime(s->tfd, 0, &interval, NULL);
+	timerfd_settime(s->tfd, TFD_TIMER_ABSTIME, &interval, NULL);
 }
 
 void
 sender_cleanup(struct sender *s)
 {
+	free(s->batch_memory);
 	close(s->tfd);
 }
 
+/*
+ * Every message of the burst has one IO vector pointing
+ * to its own probe. All of them go to the mirror.
+ *
+ * Only the header is sent, unless the probes are extended
+ * with the send time or room for the mirror timestamps
+ * (zeroed here).
+ */
+static int
+setup_batch(struct sender *s)
+{
+	unsigned int i;
+	size_t size;
+	void *tmp;
+
+	size = s->packet_count *
+	       (sizeof(*s->msgs) + sizeof(*s->iovs) +
+	        sizeof(*s->probes) + sizeof(*s->overwritten));
+
+	/*
+	 * the copies of the send history entries go first,
+	 * aligned like the send history itself (see
+	 * SEND_HISTORY_ALIGNED)
+	 */
+	if (posix_memalign(&s->batch_memory,
+	                   __alignof__(struct sent_packet), size) != 0)
+		return -1;
+	memset(s->batch_memory, 0, size);
+
+	tmp = s->batch_memory;
+	s->overwritten = tmp;
+	tmp += s->packet_count * sizeof(*s->overwritten);
+	s->msgs = tmp;
+	tmp += s->packet_count * sizeof(*s->msgs);
+	s->iovs = tmp;
+	tmp += s->packet_count * sizeof(*s->iovs);
+	s->probes = tmp;
+
+	for (i = 0; i < s->packet_count; i++) {
+		s->iovs[i].iov_base = &s->probes[i];
+		s->iovs[i].iov_len =
+		  s->mirror_timestamps || s->send_time != SEND_TIME_HISTORY ?
+		  sizeof(s->probes[i]) : PROBE_HEADER_SIZE;
+
+		s->msgs[i].msg_hdr.msg_name = &s->addr;
+		s->msgs[i].msg_hdr.msg_namelen = sizeof(s->addr);
+		s->msgs[i].msg_hdr.msg_iov = &s->iovs[i];
+		s->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return 0;
+}
+
 int
-sender_setup(struct sender *s, unsigned int sleep_ms,
+sender_setup(struct sender *s, uint64_t interval_ns, uint64_t spin_ns,
              unsigned int packet_count)
 {
 	/* timerfd allows waiting for expiration on a file descriptor */
@@ -241,13 +668,21 @@ sender_setup(struct sender *s, unsigned int sleep_ms,
 	if (s->tfd == -1)
 		return -1;
 
-	/* convert milliseconds to struct timespec */
-	s->sleep_interval.tv_sec = sleep_ms / 1000;
-	s->sleep_interval.tv_nsec = (sleep_ms % 1000) * 1000000;
+	/* convert nanoseconds to struct timespec */
+	nanoseconds_to_timespec(&s->sleep_interval, interval_ns);
+	s->interval_ns = interval_ns;
+
+	/* spinning longer than the interval makes no sense */
+	s->spin_ns = spin_ns < interval_ns ? spin_ns : interval_ns;
 
 	/* number of packets to send on every timer expiration */
 	s->packet_count = packet_count;
 
+	if (setup_batch(s) == -1) {
+		close(s->tfd);
+		return -1;
+	}
+
 	s->current_id = 0;
 
 #ifdef SEND_COUNT
@@ -259,6 +694,12 @@ sender_setup(struct sender *s, unsigned int sleep_ms,
 #endif
 
 	s->total_packets_sent = 0;
+	s->total_packets_lost = 0;
+	s->total_packets_late = 0;
+	s->timer_overruns = 0;
+	s->skipped_bursts = 0;
+	histogram_reset(&s->departure_error);
+	histogram_reset(&s->send_syscall);
 
 	return 0;
 }
@@ -22,12 +22,20 @@
 #include <stdint.h> /* uint64_t */
 #include <time.h> /* struct timespec */
 #include <netinet/in.h> /* struct sockaddr_in */
+#include <sys/socket.h> /* struct mmsghdr (_GNU_SOURCE) */
 
+#include "histogram.h"
+#include "probe.h"
 #include "send_history.h"
 #ifdef WRITE_IN_SENDER
 #include "result_buffer.h"
 #endif
 
+/* what to do when the timer expires more than once */
+#define SENDER_OVERRUN_ABORT  0
+#define SENDER_OVERRUN_SKIP   1
+#define SENDER_OVERRUN_LATE   2
+
 struct sender {
 	/* from main */
 #ifdef WRITE_IN_SENDER
@@ -37,7 +45,7 @@ struct sender {
 	int sfd;
 #ifdef SEND_COUNT
 	unsigned int send_count;
-	unsigned int max_latency;
+	uint64_t max_latency_ns;
 #endif
 	struct sockaddr_in addr;
 
@@ -45,9 +53,41 @@ struct sender {
 
 	/* sleep interval */
 	struct timespec sleep_interval;
+	uint64_t interval_ns;
+
+	/*
+	 * precise pacing: the timer expires spin_ns before
+	 * the deadline, and we busy-wait the rest of it.
+	 * Disabled if zero.
+	 */
+	uint64_t spin_ns;
+	/* CLOCK_MONOTONIC time the next burst is due */
+	uint64_t next_deadline;
+
+	int overrun_policy;
+	/* send extended probes, see probe.h (boolean) */
+	int mirror_timestamps;
+	/* SEND_TIME_* from probe.h */
+	int send_time;
+	/*
+	 * TX stages: put the time before the send call in
+	 * the send history entries (boolean)
+	 */
+	int tx_stages;
 	/* number of packets to send per run */
 	unsigned int packet_count;
 
+	/*
+	 * the burst sent with sendmmsg() on every timer
+	 * expiration (packet_count entries each)
+	 */
+	void *batch_memory;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct probe *probes;
+	/* entries of send history overwritten by the burst */
+	struct sent_packet *overwritten;
+
 	/* runtime information */
 	uint64_t current_id;
 
@@ -57,6 +97,17 @@ struct sender {
 
 	/* log */
 	uint64_t total_packets_sent;
+	/* timeout reached without being received */
+	uint64_t total_packets_lost;
+	/* sent late (see SENDER_OVERRUN_LATE) */
+	uint64_t total_packets_late;
+	/* timer expirations missed, and bursts not sent because of it */
+	uint64_t timer_overruns;
+	uint64_t skipped_bursts;
+	/* how late bursts leave compared to their deadline (ns) */
+	struct histogram departure_error;
+	/* TX stages: duration of the send calls of a burst (ns) */
+	struct histogram send_syscall;
 };
 
 #ifdef WRITE_IN_SENDER
@@ -74,7 +125,7 @@ void
 sender_cleanup(struct sender *s);
 
 int
-sender_setup(struct sender *s, unsigned int sleep_ms,
+sender_setup(struct sender *s, uint64_t interval_ns, uint64_t spin_ns,
              unsigned int packet_count);
 
 #endif /* SENDER_H */
@@ -20,111 +20,126 @@
  * 11/05/2018
  *
  * polling run
+ *
+ * All elements but the writer run in this thread, in
+ * one reactor (see reactor.c).
  */
 
-#include <poll.h>
 #include <signal.h> /* sigfillset */
+#include <stdio.h> /* stdout */
 #include <sys/signalfd.h>
 #include <unistd.h> /* close() */
 
 #include "single_thread.h"
 #include "measurer_elements.h"
+#include "reactor.h"
 
 #include "sender.h" /* sender_do_its_job() */
 #include "storer.h" /* storer_do_its_job() */
 #include "receiver.h" /* receiver_do_its_job() */
+#include "histogram.h" /* histogram_print() */
+#include "stats.h" /* stats_do_its_job() */
 
 enum {
 	SIGNAL_FD,
 	TIMER_FD,
 	SEND_FD,
 	RECV_FD,
+	STATS_FD,
+	N_FDS,
 };
 
-static void
-setup_poll_fd(struct pollfd *pfd, int fd, short events)
+/* what the signal source handler needs */
+struct signal_ctx {
+	struct measurer_elements *e;
+	int fd;
+};
+
+/*
+ * Return REACTOR_STOP if a signal asks us to exit.
+ * SIGUSR1 only dumps the latency summary.
+ */
+static int
+handle_signal(void *data)
 {
-	pfd->fd = fd;
-	pfd->events = events;
+	struct signal_ctx *s = data;
+	struct signalfd_siginfo info;
+
+	while (read(s->fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo != SIGUSR1)
+			return REACTOR_STOP;
+
+		histogram_print(&s->e->receiver->histogram, stdout,
+		                "round trip latency");
+	}
+
+	return 0;
 }
 
-static inline void
-clean_revents(struct pollfd *pfd, int n)
+static void
+setup_source(struct reactor_source *s, int fd, int (*handler)(void*),
+             void *data)
 {
-	while (n--)
-		pfd[n].revents = 0;
+	s->fd = fd;
+	s->handler = handler;
+	s->data = data;
 }
 
 /*
- * Check order: signal, send timer, send timestamp,
- * receive.
+ * Every element does its job when its file descriptor
+ * wakes us up: the sender sends the packets and stores
+ * their ids in ring buffer, the storer stores the send
+ * timestamps, the receiver receives the packets and
+ * the stats write interval statistics.
  */
 static int
 run(struct measurer_elements *e, int signal_fd)
 {
-	struct pollfd pfd[4];
-	int keep_running = 1;
-
-	/* temporary */
-	int tmp;
-
-	/* setup poll file descriptors */
-
-	setup_poll_fd(&pfd[SIGNAL_FD], signal_fd,             POLLIN);
-	setup_poll_fd(&pfd[TIMER_FD],  e->sender->tfd,        POLLIN);
-	/* maybe POLLIN when SO_SELECT_ERRQUEUE is not available */
-	setup_poll_fd(&pfd[SEND_FD],   e->sender->sfd,   POLLPRI);
-	setup_poll_fd(&pfd[RECV_FD],   e->receiver->sfd, POLLIN);
+	struct reactor reactor;
+	struct reactor_source sources[N_FDS];
+	struct signal_ctx signal_ctx;
+	int ret = -1;
+
+	if (reactor_setup(&reactor) == -1)
+		return -1;
+
+	signal_ctx.e = e;
+	signal_ctx.fd = signal_fd;
+
+	setup_source(&sources[SIGNAL_FD], signal_fd, handle_signal,
+	             &signal_ctx);
+	setup_source(&sources[TIMER_FD], e->sender->tfd,
+	             (void*) sender_do_its_job, e->sender);
+	setup_source(&sources[SEND_FD], e->sender->sfd,
+	             (void*) storer_do_its_job, e->storer);
+	setup_source(&sources[RECV_FD], e->receiver->sfd,
+	             (void*) receiver_do_its_job, e->receiver);
+
+	if (reactor_add(&reactor, &sources[SIGNAL_FD], EPOLLIN) == -1
+	    || reactor_add(&reactor, &sources[TIMER_FD], EPOLLIN) == -1
+	    /* maybe EPOLLIN when SO_SELECT_ERRQUEUE is not available */
+	    || reactor_add(&reactor, &sources[SEND_FD], EPOLLPRI) == -1
+	    || reactor_add(&reactor, &sources[RECV_FD], EPOLLIN) == -1)
+		goto _go_cleanup_reactor;
+
+	/* interval statistics are optional */
+	if (e->stats) {
+		setup_source(&sources[STATS_FD], e->stats->tfd,
+		             (void*) stats_do_its_job, e->stats);
+		if (reactor_add(&reactor, &sources[STATS_FD], EPOLLIN) == -1)
+			goto _go_cleanup_reactor;
+	}
 
 	sender_timer_start(e->sender);
+	if (e->stats)
+		stats_timer_start(e->stats);
 
-	while (keep_running) {
-		/* wait (poll) for an event */
-		clean_revents(pfd, 4);
-		tmp = poll(pfd, 4, -1);
-		if (tmp == -1)
-			goto _go_exit_err;
-
-		if (pfd[SIGNAL_FD].revents & POLLIN) {
-			/* check the signal and exit */
-			/* Exiting here. TODO: Maybe it's temporary. */
-			keep_running = 0;
-			continue;
-		}
-
-		if (pfd[TIMER_FD].revents & POLLIN) {
-			/*
-			 * send the packet and store its id in ring buffer
-			 *
-			 * Idea: perhaps we can send the result to the
-			 * writer here, when we overwrite IDs.
-			 *
-			 * probably the writer is a separate thread
-			 * and we'll communicate to it using
-			 * m->pipe[1] variable.
-			 */
-
-			if (sender_do_its_job(e->sender) == -1)
-				goto _go_exit_err;
-		}
-
-		/* maybe POLLIN when SO_SELECT_ERRQUEUE is not available */
-		if (pfd[SEND_FD].revents & POLLPRI) {
-			if (storer_do_its_job(e->storer) == -1)
-				goto _go_exit_err;
-		}
-
-		if (pfd[RECV_FD].revents & POLLIN) {
-			/* receive packet and store timestamp in ring buffer */
-			if (receiver_do_its_job(e->receiver) == -1)
-				goto _go_exit_err;
-		}
-	}
+	/* Exiting on a signal. TODO: Maybe it's temporary. */
+	ret = reactor_run(&reactor);
 
-	return 0;
-
-_go_exit_err:
-	return -1;
+_go_cleanup_reactor:
+	reactor_cleanup(&reactor);
+	return ret;
 }
 
 #define set_and_goto(var, val, label) \
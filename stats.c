@@ -0,0 +1,183 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * periodic interval statistics
+ *
+ * Every interval, a single line with what happened since
+ * the previous one is written to the stats file, so it can
+ * be followed while the measurement runs:
+ *
+ *   <elapsed_s> sent=<n> timestamped=<n> received=<n>
+ *   lost=<n> duplicates=<n> misses=<n> overruns=<n>
+ *   skipped=<n> late=<n> min=<ms> avg=<ms> p50=<ms>
+ *   p90=<ms> p99=<ms> max=<ms>
+ *
+ * `lost` are packets whose timeout elapsed (the sender
+ * overwrote their entry) in the interval without being
+ * received. `overruns` are missed send timer expirations,
+ * `skipped` the intervals not sent because of them and
+ * `late` the packets sent after their deadline (see -O).
+ * min and max have the histogram precision.
+ *
+ * In multi thread mode the counters are read while the
+ * other threads update them, so a record may be slightly
+ * off. The next one makes up for it.
+ */
+
+#include <stdint.h> /* uint64_t */
+#include <stdio.h> /* fprintf() fopen() */
+#include <string.h> /* memcpy() */
+#include <sys/timerfd.h> /* timerfd_*() */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* read() close() */
+
+#include "stats.h"
+
+#include "histogram.h"
+#include "time_common.h" /* time_diff() */
+
+static void
+read_counters(struct stats *s, struct stats_counters *c)
+{
+	c->sent       = s->sender->total_packets_sent;
+	c->stored     = s->storer->total_packets_stored;
+	c->received   = s->receiver->valid_packets;
+	c->lost       = s->sender->total_packets_lost;
+	c->duplicates = s->receiver->duplicate_packets;
+	c->misses     = s->result_buffer->misses;
+	c->nsec_sum   = s->receiver->nsec_sum;
+	c->overruns   = s->sender->timer_overruns;
+	c->skipped    = s->sender->skipped_bursts;
+	c->late       = s->sender->total_packets_late;
+}
+
+#define ms_arg(ns)  (ns) / 1000000, (ns) % 1000000
+
+static void
+write_record(struct stats *s, struct stats_counters *now,
+             struct timespec *elapsed)
+{
+	struct stats_counters *prev = &s->previous;
+	struct histogram *h = &s->interval_histogram;
+	uint64_t received = now->received - prev->received;
+	uint64_t avg = 0;
+
+	if (received)
+		avg = (now->nsec_sum - prev->nsec_sum) / received;
+
+	fprintf(s->file,
+	        "%ld.%03ld sent=%lu timestamped=%lu received=%lu "
+	        "lost=%lu duplicates=%lu misses=%lu "
+	        "overruns=%lu skipped=%lu late=%lu "
+	        "min=%lu.%06lu avg=%lu.%06lu p50=%lu.%06lu "
+	        "p90=%lu.%06lu p99=%lu.%06lu max=%lu.%06lu\n",
+	        elapsed->tv_sec, elapsed->tv_nsec / 1000000,
+	        now->sent - prev->sent,
+	        now->stored - prev->stored,
+	        received,
+	        now->lost - prev->lost,
+	        now->duplicates - prev->duplicates,
+	        now->misses - prev->misses,
+	        now->overruns - prev->overruns,
+	        now->skipped - prev->skipped,
+	        now->late - prev->late,
+	        ms_arg(h->total ? h->min : 0),
+	        ms_arg(avg),
+	        ms_arg(histogram_percentile(h, 50.0)),
+	        ms_arg(histogram_percentile(h, 90.0)),
+	        ms_arg(histogram_percentile(h, 99.0)),
+	        ms_arg(h->max));
+	fflush(s->file);
+}
+
+int
+stats_do_its_job(struct stats *s)
+{
+	struct stats_counters now;
+	struct timespec current;
+	struct timespec elapsed;
+	uint64_t expirations;
+
+	if (read(s->tfd, &expirations, sizeof(expirations))
+	    != sizeof(expirations))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &current);
+	time_diff(&elapsed, &current, &s->start);
+
+	read_counters(s, &now);
+
+	histogram_subtract(&s->interval_histogram, &s->receiver->histogram,
+	                   &s->previous_histogram);
+	write_record(s, &now, &elapsed);
+
+	/* the current state is the base of the next interval */
+	s->previous = now;
+	memcpy(&s->previous_histogram, &s->receiver->histogram,
+	       sizeof(s->previous_histogram));
+
+	return 0;
+}
+
+void
+stats_timer_start(struct stats *s)
+{
+	struct itimerspec interval;
+
+	interval.it_value = s->interval;
+	interval.it_interval = s->interval;
+
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	timerfd_settime(s->tfd, 0, &interval, NULL);
+}
+
+void
+stats_cleanup(struct stats *s)
+{
+	close(s->tfd);
+	if (s->file != stderr)
+		fclose(s->file);
+}
+
+int
+stats_setup(struct stats *s, unsigned int interval_s, char *stats_file)
+{
+	s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (s->tfd == -1)
+		return -1;
+
+	s->interval.tv_sec = interval_s;
+	s->interval.tv_nsec = 0;
+
+	if (stats_file == NULL) {
+		s->file = stderr;
+	} else {
+		/* 'a': dashboards may be following the file */
+		s->file = fopen(stats_file, "a");
+		if (s->file == NULL) {
+			close(s->tfd);
+			return -1;
+		}
+	}
+
+	memset(&s->previous, 0, sizeof(s->previous));
+	histogram_reset(&s->previous_histogram);
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h> /* uint64_t */
+#include <stdio.h> /* FILE* */
+#include <time.h> /* struct timespec */
+
+#include "histogram.h"
+#include "receiver.h"
+#include "result_buffer.h"
+#include "sender.h"
+#include "storer.h"
+
+/* counters of the elements at a given time */
+struct stats_counters {
+	uint64_t sent;
+	uint64_t stored;
+	uint64_t received;
+	uint64_t lost;
+	uint64_t duplicates;
+	uint64_t misses;
+	uint64_t nsec_sum;
+	uint64_t overruns;
+	uint64_t skipped;
+	uint64_t late;
+};
+
+struct stats {
+	/* from main */
+	struct sender        *sender;
+	struct storer        *storer;
+	struct receiver      *receiver;
+	struct result_buffer *result_buffer;
+
+	/* the file where records are written */
+	FILE *file;
+
+	int tfd; /* timer fd */
+	struct timespec interval;
+	struct timespec start;
+
+	/* state at the previous record */
+	struct stats_counters previous;
+	struct histogram previous_histogram;
+
+	/* values recorded in the current interval */
+	struct histogram interval_histogram;
+};
+
+int
+stats_do_its_job(struct stats *s);
+
+void
+stats_timer_start(struct stats *s);
+
+void
+stats_cleanup(struct stats *s);
+
+int
+stats_setup(struct stats *s, unsigned int interval_s, char *stats_file);
+
+#endif /* STATS_H */
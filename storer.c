@@ -24,6 +24,10 @@
  * 18:02 23/10/2017: revised
  */
 
+#define _GNU_SOURCE /* struct mmsghdr */
+
+#include <errno.h> /* ENOMSG */
+#include <netinet/in.h> /* SOL_IP IP_RECVERR */
 #include <stdint.h> /* int*_t */
 #include <time.h> /* struct timespec */
 
@@ -35,7 +39,8 @@
 
 #include "storer.h"
 
-#include "msgctx.h" /* msgctx_*() */
+#include "histogram.h" /* histogram_record() */
+#include "msgctx.h" /* mmsgctx_*() */
 #include "send_history.h" /* struct send_history */
 #include "time_common.h" /* get_timestamp_from_msg() */
 
@@ -45,37 +50,147 @@
                      sizeof(struct iphdr) + \
                      sizeof(struct udphdr))
 
+/* maximum number of timestamps read in one recvmmsg() */
+#define STORER_BATCH_SIZE  64
+
+/*
+ * The timestamp comes with an IP_RECVERR control message,
+ * which tells its type (ee_info: SCM_TSTAMP_SCHED or
+ * SCM_TSTAMP_SND) and, with SOF_TIMESTAMPING_OPT_ID, the
+ * kernel counter of the packet (ee_data).
+ */
+static struct sock_extended_err*
+get_error_from_msg(struct msghdr *msg)
+{
+	struct sock_extended_err *err;
+	struct cmsghdr *cmsg;
+
+	for_each_cmsg (msg, cmsg) {
+		if (cmsg->cmsg_level == SOL_IP &&
+		    cmsg->cmsg_type == IP_RECVERR) {
+			err = (void*) CMSG_DATA(cmsg);
+			if (err->ee_errno != ENOMSG ||
+			    err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+				return NULL;
+
+			return err;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Get the id of the packet the timestamp refers to.
+ *
+ * Without OPT_ID, the kernel loops the whole packet back
+ * and the id is in its header, after the eth, ip and udp
+ * headers.
+ *
+ * With OPT_ID, the kernel counts the packets sent from
+ * zero, as the sender does with the ids. The counter has
+ * only 32 bits, so it's extended here with the last one
+ * seen, which allows timestamps to arrive out of order.
+ */
 static int
-process_packet(struct storer *s, struct msgctx *mctx)
+get_id(struct storer *s, struct sock_extended_err *err, void *data,
+       size_t len, uint64_t *id)
 {
-	/* pointer to packet timestamp in control message */
-	struct scm_timestamping *ts;
-	uint64_t id;
-	//uint64_t flags;
-	struct sent_packet *tmp;
+	uint64_t *packet_header;
+
+	if (s->opt_id) {
+		if (err == NULL)
+			return -1;
+
+		s->packet_count += (int32_t) (err->ee_data -
+		                              (uint32_t) s->packet_count);
+		*id = s->packet_count % s->send_history->packet_id_boundary;
+		return 0;
+	}
 
 	/*
 	 * error if packet lenght is less than expected
 	 *
 	 * HEADER_SIZE refers to eth, ip and udp headers.
 	 */
-	if (mctx->len < HEADER_SIZE + sizeof(*s->packet_header))
-		goto _go_drop_packet;
+	if (len < HEADER_SIZE + sizeof(*packet_header))
+		return -1;
+
+	packet_header = data + HEADER_SIZE;
+
+	*id = *packet_header & 0x000000ffffffffff;
+
+	return 0;
+}
+
+static uint64_t
+stage_ns(struct timespec *stop, struct timespec *start)
+{
+	struct timespec diff;
 
-	id = *s->packet_header & 0x000000ffffffffff;
-	//flags = *s->packet_header & 0xffffff0000000000;
+	/* the kernel timestamps are in order, but not the user's */
+	if (time_is_greater(start, stop))
+		return 0;
+
+	time_diff(&diff, stop, start);
+	return timespec_to_nanoseconds(&diff);
+}
+
+/*
+ * TX stages: store the TX_SOFTWARE timestamp (the packet
+ * was handed to the driver) in its own field and flag, so
+ * it doesn't get in the way of the TX_SCHED one, which the
+ * receiver uses.
+ */
+static int
+store_software_ts(struct storer *s, struct sent_packet *entry,
+                  uint64_t state, struct timespec *ts)
+{
+	uint64_t id = sent_packet_id(state);
+
+	if (sent_packet_flags(state) & PACKET_TX_SOFTWARE)
+		return -1;
+
+	entry->sw_ts = *ts;
+
+	while (!sent_packet_set_flags(entry, &state, PACKET_TX_SOFTWARE)) {
+		if (sent_packet_id(state) != id)
+			return -1;
+	}
+
+	/* the storer itself wrote ts */
+	if (sent_packet_flags(state) & PACKET_TIMESTAMPED)
+		histogram_record(&s->queue_delay, stage_ns(ts, &entry->ts));
+
+	return 0;
+}
+
+static int
+process_packet(struct storer *s, struct msghdr *msg, void *data,
+               size_t len)
+{
+	/* pointer to packet timestamp in control message */
+	struct scm_timestamping *ts;
+	struct sock_extended_err *err;
+	uint64_t id;
+	uint64_t state;
+	struct sent_packet *tmp;
+
+	err = get_error_from_msg(msg);
+
+	if (get_id(s, err, data, len, &id) == -1)
+		return -1;
 
 	/* get timestamp from message struct */
-	ts = get_timestamp_from_msg(&mctx->msg);
+	ts = get_timestamp_from_msg(msg);
 	/* error if packet doesn't carry timestamp */
 	if (ts == NULL)
-		goto _go_drop_packet;
-
-	/* NOTE: enter critical region */
-	pthread_mutex_lock(&s->send_history->mtx);
+		return -1;
 
 	tmp = &s->send_history->buffer[id % s->send_history->control.size];
 
+	state = sent_packet_load(tmp);
+
 	/*
 	 * error if packet id is invalid
 	 *
@@ -84,30 +199,65 @@ process_packet(struct storer *s, struct msgctx *mctx)
 	 * case a bigger buffer size (max_latency) solves
 	 * the problem. Otherwise, it's very unexpected.
 	 */
-	if (tmp->id != id)
-		goto _go_unlock_mutex_and_drop_packet;
+	if (sent_packet_id(state) != id
+	    || !(sent_packet_flags(state) & PACKET_SENT))
+		return -1;
 
-	tmp->ts = ts->ts[0];
+	/* only requested with TX stages */
+	if (err != NULL && err->ee_info == SCM_TSTAMP_SND)
+		return store_software_ts(s, tmp, state, &ts->ts[0]);
 
-	/* set a flag that entry has been timestamped */
-	tmp->flags |= PACKET_TIMESTAMPED;
+	/*
+	 * error if the entry has already been timestamped
+	 *
+	 * The receiver may be reading the timestamp, so it
+	 * must not be written again.
+	 */
+	if (sent_packet_flags(state) & PACKET_TIMESTAMPED)
+		return -1;
+
+	/*
+	 * If the sender overwrites the entry now, the
+	 * timestamp is written in vain, but it's not used
+	 * until the timestamp of the new id arrives here.
+	 */
+	tmp->ts = ts->ts[0];
 
-	/* NOTE: exit critical region */
-	pthread_mutex_unlock(&s->send_history->mtx);
+	/*
+	 * set a flag that entry has been timestamped
+	 *
+	 * It fails if the entry was overwritten. Otherwise
+	 * the receiver has just set PACKET_RECEIVED, which
+	 * happens with SEND_TIME_MERGE (see probe.h), or we
+	 * have stored the TX_SOFTWARE timestamp first, and we
+	 * try again.
+	 */
+	while (!sent_packet_set_flags(tmp, &state, PACKET_TIMESTAMPED)) {
+		if (sent_packet_id(state) != id)
+			return -1;
+	}
 
 	s->total_packets_stored++;
 
-	return 0;
+	/* the sender wrote userspace_ts before the send call */
+	if (s->tx_stages) {
+		histogram_record(&s->sched_delay,
+		                 stage_ns(&tmp->ts, &tmp->userspace_ts));
+		if (sent_packet_flags(state) & PACKET_TX_SOFTWARE)
+			histogram_record(&s->queue_delay,
+			                 stage_ns(&tmp->sw_ts, &tmp->ts));
+	}
 
-_go_unlock_mutex_and_drop_packet:
-	pthread_mutex_unlock(&s->send_history->mtx);
-_go_drop_packet:
-	return -1;
+	return 0;
 }
 
 int
 storer_do_its_job(struct storer *s)
 {
+	struct mmsgctx *m = &s->mctx;
+	int count;
+	int i;
+
 	/*
 	 * process all packets we can read
 	 *
@@ -118,8 +268,12 @@ storer_do_its_job(struct storer *s)
 	 * performance seems to be affected. See
 	 * "Implementation FAQ" in README.
 	 */
-	while (msgctx_recv(s->sfd, &s->mctx, MSG_ERRQUEUE) == 0)
-		process_packet(s, &s->mctx);
+	while ((count = mmsgctx_recv(s->sfd, m, MSG_ERRQUEUE)) > 0) {
+		for (i = 0; i < count; i++) {
+			process_packet(s, mmsgctx_msg(m, i),
+			               mmsgctx_data(m, i), mmsgctx_len(m, i));
+		}
+	}
 
 	return 0;
 }
@@ -127,7 +281,7 @@ storer_do_its_job(struct storer *s)
 void
 storer_cleanup(struct storer *s)
 {
-	msgctx_destroy(&s->mctx);
+	mmsgctx_destroy(&s->mctx);
 }
 
 int
@@ -136,21 +290,22 @@ storer_setup(struct storer *s)
 	int t;
 
 	/*
-	 * msgctx_init(..., data_size, control_size, addr_size);
+	 * mmsgctx_init(..., count, data_size, control_size, addr_size);
 	 * We set addr_size to zero because we don't want
 	 * address field. In `control_size`, we might use
 	 * `CMSG_SPACE( sizeof(struct scm_timestamping) )`
 	 * but it may not be sufficient if more than one
 	 * cmsg arrives.
 	 */
-	t = msgctx_init(&s->mctx, HEADER_SIZE + sizeof(uint64_t), 1024, 0);
+	t = mmsgctx_init(&s->mctx, STORER_BATCH_SIZE,
+	                 HEADER_SIZE + sizeof(uint64_t), 1024, 0);
 	if (t == -1)
 		return -1;
 
-	s->packet_data = s->mctx.msg.msg_iov[0].iov_base;
-	s->packet_header = (void*) s->packet_data + HEADER_SIZE;
-
 	s->total_packets_stored = 0;
+	s->packet_count = 0;
+	histogram_reset(&s->sched_delay);
+	histogram_reset(&s->queue_delay);
 
 	return 0;
 }
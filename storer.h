@@ -21,6 +21,7 @@
 
 #include <stdint.h> /* uint64_t */
 
+#include "histogram.h"
 #include "msgctx.h"
 #include "send_history.h"
 
@@ -28,13 +29,31 @@ struct storer {
 	/* from main */
 	struct send_history *send_history;
 	int sfd;
+	/*
+	 * timestamps are correlated by the kernel packet
+	 * counter (SOF_TIMESTAMPING_OPT_ID) and carry no
+	 * packet data (OPT_TSONLY). Boolean.
+	 */
+	int opt_id;
+	/* TX stages, see sender.h (boolean) */
+	int tx_stages;
 
-	struct msgctx mctx;
-	void *packet_data;
-	uint64_t *packet_header;
+	/* error queue messages received at once */
+	struct mmsgctx mctx;
+
+	/* OPT_ID: kernel counter extended to 64 bits */
+	uint64_t packet_count;
 
 	/* log */
 	uint64_t total_packets_stored;
+
+	/*
+	 * TX stages (ns): from the send call to the qdisc
+	 * (TX_SCHED) and from the qdisc to the driver
+	 * (TX_SOFTWARE)
+	 */
+	struct histogram sched_delay;
+	struct histogram queue_delay;
 };
 
 int
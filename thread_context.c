@@ -22,73 +22,94 @@
  * generic thread set up and routine
  */
 
-#include <poll.h> /* poll() */
+#define _GNU_SOURCE /* sched_setaffinity() */
+
 #include <pthread.h>
+#include <sched.h> /* cpu_set_t SCHED_* */
 #include <signal.h> /* kill() SIGINT */
+#include <stdio.h> /* printf() */
 #include <string.h> /* memset() */
 #include <sys/eventfd.h> /* eventfd */
+#include <sys/syscall.h> /* SYS_sched_setattr */
 #include <sys/types.h>
-#include <unistd.h> /* close() getpid() */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* close() getpid() syscall() */
 
 #include "thread_context.h"
 
+#include "reactor.h"
+
 /*
- * efd: evend fd (see eventfd.2 manual) here is used to
- * signal the thread to exit.
- *
- * NOTE: About returning -1 on error, poll() may have
- * succeed and revents = -1. However it's very unlikely
- * the revents mask we get equals -1
+ * sched_setattr() has no glibc wrapper, and the header
+ * of the kernel (linux/sched/types.h) conflicts with
+ * sched.h. See sched_setattr.2 manual.
  */
-static short
-do_wait(int efd, int fd, short events)
-{
-	struct pollfd pfd[2];
+struct sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t  sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
 
-	/* prepare */
-	memset(pfd, 0, sizeof(pfd));
-	pfd[0].fd = efd;
-	pfd[0].events = POLLIN;
-	pfd[1].fd = fd;
-	pfd[1].events = events;
+/* the exit event fd (efd) has been written */
+static int
+stop_thread(void *data)
+{
+	(void) data;
+	return REACTOR_STOP;
+}
 
-	/* poll */
-	if (poll(pfd, 2, -1) == -1)
-		return -1;
+/*
+ * Wait for the thread's fd and its exit event fd (see
+ * eventfd.2 manual), registered in the reactor by
+ * thread_context_setup().
+ */
+static int
+generic_thread_run(struct thread_ctx *r)
+{
+	/* We're not checking for _keep_running anymore */
+	if (reactor_run(&r->reactor) == -1)
+		goto _go_exit_err;
 
-	/*
-	 * if true, user have request us to quit
-	 * Do not check _keep_running!
-	 */
-	if (pfd[0].revents & POLLIN)
-		pthread_exit(0);
+	return 0;
 
-	return pfd[1].revents;
+_go_exit_err:
+	/* shutdown other threads by sending SIGINT signal to the process */
+	kill(getpid(), SIGINT);
+	return -1;
 }
 
-static int
-generic_thread_run(struct thread_ctx *r)
+static uint64_t
+clock_ns(clockid_t clock)
 {
-	short revents;
+	struct timespec t;
 
-	/* We're not checking for _keep_running anymore */
-	while (1) {
-		/*
-		 * POLLERR is ignored because it's set by
-		 * default. See poll.2 manual
-		 */
-		revents = do_wait(r->efd, r->fd, r->events);
-		if (revents == -1)
-			goto _go_exit_err;
+	clock_gettime(clock, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
 
-		/* poll again if we haven't woken up with r->events */
-		if (!(revents & r->events))
-			continue;
+/*
+ * busy-poll: there's no poll(), the routine reads whatever
+ * is available without blocking and is called again. The
+ * CPU used is accounted at exit.
+ */
+static int
+spin_thread_run(struct thread_ctx *r)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
 
+	while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
 		if (r->routine(r->data) == -1)
 			goto _go_exit_err;
 	}
 
+	r->wall_ns = clock_ns(CLOCK_MONOTONIC) - start;
+	r->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
 	return 0;
 
 _go_exit_err:
@@ -100,7 +121,16 @@ _go_exit_err:
 static void*
 generic_thread_routine(void *data)
 {
-	if (generic_thread_run((struct thread_ctx*) data) == 0)
+	struct thread_ctx *c = data;
+
+	if (thread_sched_apply(&c->sched) == -1) {
+		printf("could not set the CPU or scheduling of a thread\n");
+		/* shutdown other threads */
+		kill(getpid(), SIGINT);
+		pthread_exit((void*) 1);
+	}
+
+	if ((c->spin ? spin_thread_run(c) : generic_thread_run(c)) == 0)
 		pthread_exit((void*) 0); /* ok */
 	else
 		pthread_exit((void*) 1); /* error */
@@ -108,15 +138,78 @@ generic_thread_routine(void *data)
 	return NULL;
 }
 
+void
+thread_sched_init(struct thread_sched *s)
+{
+	s->cpu = -1;
+	s->policy = SCHED_OTHER;
+	s->priority = 0;
+	s->runtime_ns = 0;
+	s->deadline_ns = 0;
+	s->period_ns = 0;
+}
+
+/*
+ * Apply `s` to the calling thread.
+ *
+ * NOTE: The real-time policies need CAP_SYS_NICE (or
+ * RLIMIT_RTPRIO), and SCHED_DEADLINE can't be used with
+ * a single CPU (its affinity must be the whole root
+ * domain, see sched.7 manual).
+ */
+int
+thread_sched_apply(struct thread_sched *s)
+{
+	struct sched_param param;
+	struct sched_attr attr;
+	cpu_set_t set;
+
+	if (s->cpu != -1) {
+		CPU_ZERO(&set);
+		CPU_SET(s->cpu, &set);
+		/* zero is the calling thread */
+		if (sched_setaffinity(0, sizeof(set), &set) == -1)
+			return -1;
+	}
+
+	switch (s->policy) {
+	case SCHED_FIFO:
+		param.sched_priority = s->priority;
+		/* NOTE: pthread_* functions return error numbers */
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO,
+		                          &param) != 0)
+			return -1;
+		break;
+	case SCHED_DEADLINE:
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.sched_policy = SCHED_DEADLINE;
+		attr.sched_runtime = s->runtime_ns;
+		attr.sched_deadline = s->deadline_ns;
+		attr.sched_period = s->period_ns;
+		if (syscall(SYS_sched_setattr, 0, &attr, 0) == -1)
+			return -1;
+		break;
+	}
+
+	return 0;
+}
+
 void
 thread_context_cleanup(struct thread_ctx *c)
 {
+	reactor_cleanup(&c->reactor);
 	close(c->efd);
 }
 
+/*
+ * `events` are the EPOLL* events of `fd` that call the
+ * routine, which must read everything available (see
+ * reactor.h).
+ */
 int
 thread_context_setup(struct thread_ctx *c, int (*routine)(void*),
-                     void *data, int fd, short events)
+                     void *data, int fd, uint32_t events)
 {
 	/* create event file descriptors used to signal threads to exit */
 	c->efd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
@@ -128,7 +221,33 @@ thread_context_setup(struct thread_ctx *c, int (*routine)(void*),
 	c->fd =      fd;
 	c->events =  events;
 
+	if (reactor_setup(&c->reactor) == -1)
+		goto _go_close_efd;
+
+	c->exit_source.fd = c->efd;
+	c->exit_source.handler = stop_thread;
+	c->exit_source.data = NULL;
+	c->source.fd = fd;
+	c->source.handler = routine;
+	c->source.data = data;
+
+	if (reactor_add(&c->reactor, &c->exit_source, EPOLLIN) == -1
+	    || reactor_add(&c->reactor, &c->source, events) == -1)
+		goto _go_cleanup_reactor;
+
+	c->spin = 0;
+	thread_sched_init(&c->sched);
+	c->stop = 0;
+	c->cpu_ns = 0;
+	c->wall_ns = 0;
+
 	return 0;
+
+_go_cleanup_reactor:
+	reactor_cleanup(&c->reactor);
+_go_close_efd:
+	close(c->efd);
+	return -1;
 }
 
 int
@@ -136,6 +255,7 @@ thread_terminate(struct thread_ctx *c)
 {
 	void *ret_ptr;
 
+	__atomic_store_n(&c->stop, 1, __ATOMIC_RELAXED);
 	eventfd_write(c->efd, 1);
 	pthread_join(c->thread, &ret_ptr);
 
@@ -24,6 +24,32 @@
 #define THREAD_CONTEXT_H
 
 #include <pthread.h>
+#include <sched.h> /* SCHED_* */
+#include <stdint.h> /* uint64_t */
+
+#include "reactor.h"
+
+/* not in the sched.h of older C libraries */
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE  6
+#endif
+
+/*
+ * Where and how a thread runs, see thread_sched_apply().
+ * thread_sched_init() sets any CPU and the normal policy.
+ */
+struct thread_sched {
+	/* CPU the thread runs on, -1 for any */
+	int cpu;
+	/* SCHED_OTHER, SCHED_FIFO or SCHED_DEADLINE */
+	int policy;
+	/* SCHED_FIFO: 1 (lowest) to 99 */
+	int priority;
+	/* SCHED_DEADLINE: runtime_ns of CPU every period_ns (ns) */
+	uint64_t runtime_ns;
+	uint64_t deadline_ns;
+	uint64_t period_ns;
+};
 
 struct thread_ctx {
 	int (*routine)(void*);
@@ -31,18 +57,44 @@ struct thread_ctx {
 
 	pthread_t thread;
 
-	int   fd;
-	short events;
+	int      fd;
+	uint32_t events;
 
 	int   efd;
+
+	/* waits for fd and efd, see reactor.h */
+	struct reactor reactor;
+	struct reactor_source source;
+	struct reactor_source exit_source;
+
+	/*
+	 * busy-poll: call the routine over and over instead
+	 * of waiting in the reactor (boolean). The routine
+	 * must not block. Set before thread_start().
+	 */
+	int spin;
+	/* applied by the thread when it starts */
+	struct thread_sched sched;
+
+	/* spin: set by thread_terminate() */
+	int stop;
+	/* spin: CPU time used and time spinning, in nanoseconds */
+	uint64_t cpu_ns;
+	uint64_t wall_ns;
 };
 
+void
+thread_sched_init(struct thread_sched *s);
+
+int
+thread_sched_apply(struct thread_sched *s);
+
 void
 thread_context_cleanup(struct thread_ctx *c);
 
 int
 thread_context_setup(struct thread_ctx *c, int (*routine)(void*),
-                     void *data, int fd, short events);
+                     void *data, int fd, uint32_t events);
 
 int
 thread_terminate(struct thread_ctx *c);
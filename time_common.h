@@ -22,6 +22,7 @@
  * helpers for time calculations and timestamps
  */
 
+#include <stdint.h> /* uint64_t */
 #include <sys/types.h> /* struct msghdr */
 #include <time.h> /* struct timespec */
 #include <linux/errqueue.h> /* scm_timestamping */
@@ -56,11 +57,16 @@ time_diff(struct timespec *diff,
 }
 
 static inline void
-milliseconds_to_timespec(struct timespec *out, unsigned int ms)
+nanoseconds_to_timespec(struct timespec *out, uint64_t ns)
 {
-	out->tv_nsec = ms * 1000000;
-	out->tv_sec = out->tv_nsec / 1000000000;
-	out->tv_nsec -= out->tv_sec * 1000000000;
+	out->tv_sec = ns / 1000000000;
+	out->tv_nsec = ns % 1000000000;
+}
+
+static inline uint64_t
+timespec_to_nanoseconds(struct timespec *t)
+{
+	return t->tv_sec * 1000000000ULL + t->tv_nsec;
 }
 
 /*
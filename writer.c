@@ -19,110 +19,627 @@
 /*
  * 04/2018
  *
- * read the results from a pipe and write them to a file
+ * read the results from the result buffer and write them
+ * to a file
  */
 
-#include <stdio.h> /* FILE* fopen() fclose() fflush() */
-#include <unistd.h> /* read() */
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <errno.h> /* EINTR */
+#include <fcntl.h> /* open() fcntl() posix_fallocate() O_* */
+#include <stdint.h> /* int64_t */
+#include <stdio.h> /* FILE* fopen() fclose() fflush() fwrite() */
+#include <stdlib.h> /* malloc() posix_memalign() free() */
+#include <string.h> /* memcpy() memmove() strlen() */
+#include <sys/eventfd.h> /* eventfd_read() */
+#include <sys/mman.h> /* mmap() munmap() */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* write() close() unlink() */
 
 #include "writer.h"
 
 #include "result_buffer.h" /* struct result_buffer */
+#include "writer_format.h"
 
-#define COPY_BUFFER_SIZE  128
+/* the flags of the results are written as they are */
+#if RESULT_MIRROR_TIMESTAMPS != WRITER_RECORD_MIRROR_TIMESTAMPS \
+    || RESULT_PAYLOAD_SEND_TIME != WRITER_RECORD_PAYLOAD_SEND_TIME \
+    || RESULT_TX_SCHED_DELAY != WRITER_RECORD_TX_SCHED_DELAY \
+    || RESULT_TX_QUEUE_DELAY != WRITER_RECORD_TX_QUEUE_DELAY \
+    || RESULT_RX_WAKEUP != WRITER_RECORD_RX_WAKEUP \
+    || RESULT_LATE != WRITER_RECORD_LATE \
+    || RESULT_LOST != WRITER_RECORD_LOST \
+    || RESULT_DUPLICATE != WRITER_RECORD_DUPLICATE
+#error "RESULT_* and WRITER_RECORD_* differ"
+#endif
 
-static void
-do_output(struct writer *w, struct result *r)
+/*
+ * The results are rendered into w->out, which is written
+ * to the file once per batch (or when it gets full), with
+ * no printf(). The text is the same printf() would give:
+ * the put_*() functions below match %ld and %06ld.
+ *
+ * Binary output to a file doesn't go through stdio (see
+ * writer_setup()): w->out is a large aligned block, and
+ * only whole multiples of WRITER_BLOCK_ALIGN are written,
+ * when it gets full. The rest is written at exit.
+ *
+ * The ring output has no buffer: the records are rendered
+ * right in the mapped file.
+ */
+
+/* room for the longest record, see format_result() */
+#define WRITER_MAX_RECORD  512
+
+/* "00" to "99", to convert two digits at once */
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* like %lu */
+static char*
+put_uint(char *p, uint64_t v)
 {
-	uint64_t tmp[2];
+	char tmp[20];
+	char *t = tmp + sizeof(tmp);
+	size_t len;
+
+	while (v >= 100) {
+		t -= 2;
+		memcpy(t, &digit_pairs[v % 100 * 2], 2);
+		v /= 100;
+	}
+
+	if (v >= 10) {
+		t -= 2;
+		memcpy(t, &digit_pairs[v * 2], 2);
+	} else {
+		*--t = '0' + v;
+	}
+
+	len = tmp + sizeof(tmp) - t;
+	memcpy(p, t, len);
+	return p + len;
+}
+
+/* like %ld */
+static char*
+put_int(char *p, int64_t v)
+{
+	if (v >= 0)
+		return put_uint(p, v);
+
+	*p++ = '-';
+	return put_uint(p, -(uint64_t) v);
+}
+
+/* like %06ld, for 0 <= v < 1000000 */
+static char*
+put_frac6(char *p, uint32_t v)
+{
+	memcpy(p,     &digit_pairs[v / 10000 * 2], 2);
+	memcpy(p + 2, &digit_pairs[v / 100 % 100 * 2], 2);
+	memcpy(p + 4, &digit_pairs[v % 100 * 2], 2);
+	return p + 6;
+}
 
+static char*
+put_str(char *p, const char *s)
+{
+	size_t len = strlen(s);
+
+	memcpy(p, s, len);
+	return p + len;
+}
+
+/* a string literal, its length is known at compile time */
+#define put_literal(p, s) \
+	(memcpy(p, s, sizeof(s) - 1), (p) + sizeof(s) - 1)
+
+/* binary: native integers */
+static char*
+put_u64(char *p, uint64_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static char*
+put_u32(char *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static int64_t
+timespec_ns(struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* signed nanoseconds as milliseconds, like the round trip */
+static char*
+print_ms(char *p, int64_t ns)
+{
+	uint64_t abs_ns = ns < 0 ? -ns : ns;
+
+	if (ns < 0)
+		*p++ = '-';
+	p = put_uint(p, abs_ns / 1000000);
+	*p++ = '.';
+	return put_frac6(p, abs_ns % 1000000);
+}
+
+/* a column of a group, see output_columns() */
+struct column {
+	const char *name;
+	int valid;
+	int64_t ns;
+};
+
+/*
+ * Write a group of optional columns, signed nanosecond
+ * values, in the unit of the round trip. Unknown values:
+ * friendly says so, CSV leaves them empty and binary
+ * writes zeros.
+ */
+static char*
+output_columns(struct writer *w, struct column *c, int n, char *p)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		switch (w->output_type) {
+		case WRITER_OUTPUT_FRIENDLY:
+			p = i ? put_literal(p, ", ") : put_literal(p, " (");
+			p = put_str(p, c[i].name);
+			*p++ = ' ';
+			if (c[i].valid) {
+				p = print_ms(p, c[i].ns);
+				p = put_literal(p, " ms");
+			} else {
+				p = put_literal(p, "unknown");
+			}
+			if (i == n - 1)
+				*p++ = ')';
+			break;
+		case WRITER_OUTPUT_CSV:
+			/* microseconds */
+			*p++ = ',';
+			if (c[i].valid)
+				p = put_int(p, c[i].ns / 1000);
+			break;
+		case WRITER_OUTPUT_BINARY:
+			/* microseconds, as signed integers */
+			p = put_u64(p, c[i].valid ? c[i].ns / 1000 : 0);
+			break;
+		case WRITER_OUTPUT_BINARY_V2:
+		case WRITER_OUTPUT_RING:
+			/* nanoseconds, the flags tell if valid */
+			p = put_u64(p, c[i].valid ? c[i].ns : 0);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return p;
+}
+
+/* the optional columns of a result (see WRITER_COLUMN_*) */
+static char*
+output_optional_columns(struct writer *w, struct result *r, char *p)
+{
+	int mirror = r->flags & RESULT_MIRROR_TIMESTAMPS;
+	struct column mirror_columns[] = {
+		{ "forward", mirror, r->forward_ns },
+		{ "mirror",  mirror, r->residence_ns },
+		{ "reverse", mirror, r->reverse_ns },
+	};
+	struct column tx_columns[] = {
+		{ "send call to qdisc", r->flags & RESULT_TX_SCHED_DELAY,
+		  r->sched_delay_ns },
+		{ "qdisc to driver", r->flags & RESULT_TX_QUEUE_DELAY,
+		  r->queue_delay_ns },
+	};
+	struct column rx_columns[] = {
+		{ "rx wake-up", r->flags & RESULT_RX_WAKEUP, r->rx_wakeup_ns },
+	};
+
+	if (w->columns & WRITER_COLUMN_MIRROR)
+		p = output_columns(w, mirror_columns, 3, p);
+	if (w->columns & WRITER_COLUMN_TX_STAGES)
+		p = output_columns(w, tx_columns, 2, p);
+	if (w->columns & WRITER_COLUMN_RX_WAKEUP)
+		p = output_columns(w, rx_columns, 1, p);
+
+	return p;
+}
+
+/*
+ * Render a result at `p` and return the end of it, at most
+ * WRITER_MAX_RECORD bytes later.
+ */
+static char*
+format_result(struct writer *w, struct result *r, char *p)
+{
 	/*
 	 * Here is a place of the code you may want to
 	 * edit. This is the where measurements are
-	 * output. You can even use a printf() here :-)
+	 * output.
 	 */
 
 	switch (w->output_type) {
 	case WRITER_OUTPUT_FRIENDLY:
-		if (!r->diff.tv_sec && !r->diff.tv_nsec) {
-			fprintf(w->file, "%ld Error!\n", r->id);
-			return;
-		}
-		fprintf(w->file, "%ld %ld.%06ld ms\n",
-		        r->id,
-		        r->diff.tv_sec * 1000 + r->diff.tv_nsec / 1000000,
-		        r->diff.tv_nsec % 1000000);
+		p = put_int(p, r->id);
+		if (!r->diff.tv_sec && !r->diff.tv_nsec)
+			return put_literal(p, " Error!\n");
+		*p++ = ' ';
+		p = put_int(p, r->diff.tv_sec * 1000 +
+		               r->diff.tv_nsec / 1000000);
+		*p++ = '.';
+		p = put_frac6(p, r->diff.tv_nsec % 1000000);
+		p = put_literal(p, " ms");
+		p = output_optional_columns(w, r, p);
+		*p++ = '\n';
 		break;
 	case WRITER_OUTPUT_CSV:
+		p = put_int(p, r->id);
+		*p++ = ',';
 		if (!r->diff.tv_sec && !r->diff.tv_nsec) {
-			fprintf(w->file, "%ld,error\n", r->id);
-			return;
+			/* the optional columns stay empty */
+			p = put_literal(p, "error");
+		} else {
+			/* microseconds */
+			p = put_int(p, r->diff.tv_sec * 1000000 +
+			               r->diff.tv_nsec / 1000);
 		}
-		/* microseconds */
-		fprintf(w->file, "%ld,%ld\n", r->id,
-			r->diff.tv_sec * 1000000 + r->diff.tv_nsec / 1000);
+		p = output_optional_columns(w, r, p);
+		*p++ = '\n';
 		break;
 	case WRITER_OUTPUT_BINARY:
-		/* microseconds */
-		tmp[0] = r->id;
-		tmp[1] = r->diff.tv_sec * 1000000 + r->diff.tv_nsec / 1000;
-		fwrite(tmp, sizeof(tmp), 1, w->file);
+		/* id and microseconds */
+		p = put_u64(p, r->id);
+		p = put_u64(p, r->diff.tv_sec * 1000000 +
+		               r->diff.tv_nsec / 1000);
+		p = output_optional_columns(w, r, p);
+		break;
+	case WRITER_OUTPUT_BINARY_V2:
+	case WRITER_OUTPUT_RING:
+		/* struct writer_record, see writer_format.h */
+		p = put_u64(p, r->id);
+		p = put_u32(p, r->flags);
+		p = put_u32(p, 0);
+		p = put_u64(p, timespec_ns(&r->diff));
+		p = put_u64(p, timespec_ns(&r->send_ts));
+		p = put_u64(p, timespec_ns(&r->recv_ts));
+		p = output_optional_columns(w, r, p);
 		break;
 	default:
 		break;
 	}
+
+	return p;
+}
+
+static int
+write_all(int fd, char *buffer, size_t len)
+{
+	ssize_t tmp;
+
+	while (len) {
+		tmp = write(fd, buffer, len);
+		if (tmp == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buffer += tmp;
+		len -= tmp;
+	}
+
+	return 0;
 }
 
+/*
+ * stdio: write everything. Block output: write the
+ * aligned part and move the rest (less than an alignment
+ * unit) to the beginning.
+ */
+static int
+flush_output(struct writer *w)
+{
+	size_t len;
+
+	if (w->fd == -1) {
+		fwrite(w->out, 1, w->out_len, w->file);
+		w->out_len = 0;
+		return 0;
+	}
+
+	len = w->out_len & ~(size_t) (WRITER_BLOCK_ALIGN - 1);
+	if (write_all(w->fd, w->out, len) == -1)
+		return -1;
+
+	memmove(w->out, w->out + len, w->out_len - len);
+	w->out_len -= len;
+
+	return 0;
+}
+
+/*
+ * Ring output: tail is moved past the records about to be
+ * overwritten, then they are written and head is moved
+ * (see struct writer_ring_header in writer_format.h).
+ */
+static void
+ring_write(struct writer *w, struct result *buffer, int len)
+{
+	struct writer_ring_header *h = w->ring;
+	char *records = (char*) h + WRITER_RING_HEADER_SIZE;
+	uint64_t end = h->head + len;
+	uint64_t slot;
+	int i = 0;
+
+	if (end - h->tail > h->capacity) {
+		__atomic_store_n(&h->tail, end - h->capacity,
+		                 __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	/* the first ones would be overwritten by the last ones */
+	if ((uint64_t) len > h->capacity)
+		i = len - h->capacity;
+
+	slot = (h->head + i) % h->capacity;
+	for (; i < len; i++) {
+		format_result(w, &buffer[i],
+		              records + slot * w->header.record_size);
+		if (++slot == h->capacity)
+			slot = 0;
+	}
+
+	__atomic_store_n(&h->head, end, __ATOMIC_RELEASE);
+}
+
+/*
+ * A batch of results, written at once. Block output waits
+ * until the buffer is full.
+ */
 static int
 file_write(struct writer *w, struct result *buffer, int len)
 {
+	char *p;
 	int i;
 
-	//fprintf(w->file, "[buffer len = %d]\n", len);
-	for (i = 0; i < len; i++)
-		do_output(w, &buffer[i]);
+	if (w->ring != NULL) {
+		ring_write(w, buffer, len);
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (w->out_len + WRITER_MAX_RECORD > w->out_size
+		    && flush_output(w) == -1)
+			return -1;
+
+		p = format_result(w, &buffer[i], w->out + w->out_len);
+		w->out_len = p - w->out;
+	}
+
+	if (w->fd == -1)
+		return flush_output(w);
 
 	return 0;
 }
 
 /*
- * The writer reads at most COPY_BUFFER_SIZE entries from
- * the pipe and writes them to the file. If the other side
- * writes just one entry to the pipe, the writer will end
- * up writing just one entry to the file. In order to
- * avoid this, a buffering is done when the other side
- * writes using result_buffer_insert_entry() from
- * result_buffer.h
+ * The writer is woken up by the result buffer's eventfd and
+ * writes every result available to the file. The results
+ * are published in batches by result_buffer_insert_entry()
+ * from result_buffer.h (see `-b` option), so the writer
+ * does not wake up for every single result.
  */
 int
 writer_do_its_job(struct writer *w)
 {
-	struct result copy[COPY_BUFFER_SIZE];
-	int bytes_copied;
+	struct result_buffer *b = w->result_buffer;
+	struct result *entries;
+	unsigned int count;
+	eventfd_t value;
 
-	bytes_copied = read(w->result_buffer->readfd, copy, sizeof(copy));
-	if (bytes_copied == -1) {
-		/* TODO: what to do? */
-		return 0;
+	/* reset the doorbell */
+	eventfd_read(b->efd, &value);
+
+	do {
+		while ((count = result_buffer_peek(b, &entries)) != 0) {
+			if (file_write(w, entries, count) == -1)
+				return -1;
+			result_buffer_consume(b, count);
+		}
+	} while (!result_buffer_consumer_sleep(b));
+
+	return 0;
+}
+
+/*
+ * The last (partial) block: O_DIRECT only takes aligned
+ * lengths, so it's turned off before writing it.
+ */
+static void
+close_block_output(struct writer *w)
+{
+	int flags;
+
+	flags = fcntl(w->fd, F_GETFL);
+	if (flags != -1 && flags & O_DIRECT)
+		fcntl(w->fd, F_SETFL, flags & ~O_DIRECT);
+
+	write_all(w->fd, w->out, w->out_len);
+	close(w->fd);
+}
+
+/*
+ * Binary v2: complete the header main has filled with the
+ * run configuration
+ */
+static void
+complete_header(struct writer *w)
+{
+	struct writer_file_header *h = &w->header;
+	struct timespec now;
+	uint32_t columns = 0;
+
+	if (w->columns & WRITER_COLUMN_MIRROR)
+		columns += 3;
+	if (w->columns & WRITER_COLUMN_TX_STAGES)
+		columns += 2;
+	if (w->columns & WRITER_COLUMN_RX_WAKEUP)
+		columns += 1;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	memcpy(h->magic, WRITER_FORMAT_MAGIC, sizeof(h->magic));
+	h->version = WRITER_FORMAT_VERSION;
+	h->header_size = sizeof(*h);
+	h->record_size = sizeof(struct writer_record) +
+	                 columns * sizeof(int64_t);
+	h->columns = w->columns;
+	h->clock_id = CLOCK_REALTIME;
+	h->start_ns = timespec_ns(&now);
+	memset(h->reserved, 0, sizeof(h->reserved));
+}
+
+/* binary v2: the header goes before the first record */
+static void
+put_header(struct writer *w)
+{
+	complete_header(w);
+	memcpy(w->out, &w->header, sizeof(w->header));
+	w->out_len = sizeof(w->header);
+}
+
+/*
+ * Ring output: the file is created with its final size,
+ * with the blocks allocated, so writing to the mapping
+ * never fails, and mapped with its pages populated.
+ */
+static int
+setup_ring_output(struct writer *w, char *writer_file)
+{
+	struct writer_ring_header *h;
+	int fd;
+
+	complete_header(w);
+
+	/* the size of the file must fit in a size_t */
+	if (w->ring_records > (SIZE_MAX - WRITER_RING_HEADER_SIZE) /
+	                      w->header.record_size)
+		return -1;
+	w->ring_len = WRITER_RING_HEADER_SIZE +
+	              w->ring_records * w->header.record_size;
+
+	fd = open(writer_file, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd == -1)
+		return -1;
+
+	if (posix_fallocate(fd, 0, w->ring_len) != 0)
+		goto _go_unlink;
+
+	h = mmap(NULL, w->ring_len, PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (h == MAP_FAILED)
+		goto _go_unlink;
+
+	/* the mapping keeps the file */
+	close(fd);
+
+	h->file = w->header;
+	memcpy(h->file.magic, WRITER_RING_MAGIC, sizeof(h->file.magic));
+	h->file.header_size = WRITER_RING_HEADER_SIZE;
+	h->capacity = w->ring_records;
+	h->head = 0;
+	h->tail = 0;
+
+	w->ring = h;
+	w->fd = -1;
+	w->file = NULL;
+	w->out = NULL;
+	return 0;
+
+_go_unlink:
+	close(fd);
+	unlink(writer_file);
+	return -1;
+}
+
+/*
+ * Binary output to a file: created like fopen(..., "wx")
+ * does, optionally with O_DIRECT, and written by blocks.
+ */
+static int
+setup_block_output(struct writer *w, char *writer_file)
+{
+	int flags = O_WRONLY | O_CREAT | O_EXCL;
+
+	if (w->direct)
+		flags |= O_DIRECT;
+
+	if (posix_memalign((void**) &w->out, WRITER_BLOCK_ALIGN,
+	                   WRITER_BLOCK_SIZE) != 0)
+		return -1;
+	w->out_size = WRITER_BLOCK_SIZE;
+	w->out_len = 0;
+
+	w->fd = open(writer_file, flags, 0666);
+	if (w->fd == -1) {
+		free(w->out);
+		return -1;
 	}
-	
-	file_write(w, copy, bytes_copied / sizeof(*copy));
 
+	w->file = NULL;
 	return 0;
 }
 
 void
 writer_cleanup(struct writer *w)
 {
+	if (w->ring != NULL) {
+		munmap(w->ring, w->ring_len);
+		return;
+	}
+
+	if (w->fd != -1) {
+		close_block_output(w);
+		free(w->out);
+		return;
+	}
+
 	/* write buffered data and close file */
+	flush_output(w);
 	fflush(w->file);
 	if (w->file != stdout)
 		fclose(w->file);
+	free(w->out);
 }
 
-int
-writer_setup(struct writer *w, char *writer_file)
+static int
+setup_stdio_output(struct writer *w, char *writer_file)
 {
+	w->fd = -1;
+	w->out = malloc(WRITER_OUTPUT_SIZE);
+	if (w->out == NULL)
+		return -1;
+	w->out_size = WRITER_OUTPUT_SIZE;
+	w->out_len = 0;
+
 	if (writer_file == NULL) {
 		w->file = stdout;
 	} else {
@@ -135,8 +652,10 @@ writer_setup(struct writer *w, char *writer_file)
 		 * exists.
 		 */
 		w->file = fopen(writer_file, "wx");
-		if (w->file == NULL)
+		if (w->file == NULL) {
+			free(w->out);
 			return -1;
+		}
 
 		/*
 		 * TODO: Perhaps improve buffering using
@@ -146,3 +665,25 @@ writer_setup(struct writer *w, char *writer_file)
 
 	return 0;
 }
+
+int
+writer_setup(struct writer *w, char *writer_file)
+{
+	int ret;
+
+	w->ring = NULL;
+	if (w->output_type == WRITER_OUTPUT_RING)
+		return setup_ring_output(w, writer_file);
+
+	if ((w->output_type == WRITER_OUTPUT_BINARY
+	     || w->output_type == WRITER_OUTPUT_BINARY_V2)
+	    && writer_file != NULL)
+		ret = setup_block_output(w, writer_file);
+	else
+		ret = setup_stdio_output(w, writer_file);
+
+	if (ret == 0 && w->output_type == WRITER_OUTPUT_BINARY_V2)
+		put_header(w);
+
+	return ret;
+}
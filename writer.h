@@ -22,18 +22,60 @@
 #include <stdio.h> /* FILE* */
 
 #include "result_buffer.h" /* struct result_buffer */
+#include "writer_format.h" /* WRITER_COLUMN_* */
 
-#define WRITER_OUTPUT_FRIENDLY  0
-#define WRITER_OUTPUT_CSV       1
-#define WRITER_OUTPUT_BINARY    2
+#define WRITER_OUTPUT_FRIENDLY   0
+#define WRITER_OUTPUT_CSV        1
+#define WRITER_OUTPUT_BINARY     2
+/* with a header, see writer_format.h */
+#define WRITER_OUTPUT_BINARY_V2  3
+/* binary v2 records in a mapped circular file */
+#define WRITER_OUTPUT_RING       4
+
+/* results are rendered in a buffer of this size, see writer.c */
+#define WRITER_OUTPUT_SIZE  65536
+
+/*
+ * binary output (both versions) to a file: written by
+ * blocks of a multiple of WRITER_BLOCK_ALIGN (what
+ * O_DIRECT needs), from a buffer of WRITER_BLOCK_SIZE
+ */
+#define WRITER_BLOCK_SIZE   (1 << 20)
+#define WRITER_BLOCK_ALIGN  4096
+
+/* ring output: the records start after a page */
+#define WRITER_RING_HEADER_SIZE  4096
 
 struct writer {
 	/* from main */
 	struct result_buffer *result_buffer;
 	int output_type;
+	/* WRITER_COLUMN_* */
+	unsigned int columns;
+	/* binary output file opened with O_DIRECT (boolean) */
+	int direct;
+	/*
+	 * binary v2: the run configuration in the file header,
+	 * the writer fills the rest
+	 */
+	struct writer_file_header header;
+	/* ring output size, in records */
+	uint64_t ring_records;
 
 	/* the file where writer will write */
 	FILE *file;
+
+	/* block output (binary to a file), -1 if stdio is used */
+	int fd;
+
+	/* ring output, mapped file of ring_len bytes or NULL */
+	struct writer_ring_header *ring;
+	size_t ring_len;
+
+	/* output buffer, out_size bytes */
+	char *out;
+	size_t out_size;
+	size_t out_len;
 };
 
 int
@@ -0,0 +1,196 @@
+/*
+ * network latency measurer
+ * Copyright (C) 2018  Ricardo Biehl Pasquali <pasqualirb@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * layout of the binary output, version 2 (`-f bin2`), for
+ * the programs that read it
+ *
+ * The file starts with struct writer_file_header, followed
+ * by records of header.record_size bytes: struct
+ * writer_record and then one int64_t per optional column
+ * enabled in header.columns (WRITER_COLUMN_*), in the order
+ * they are defined below.
+ *
+ * All times are nanoseconds. Absolute times are of the
+ * clock header.clock_id (CLOCK_REALTIME), like the kernel
+ * software timestamps.
+ *
+ * The ring output (`-f ring`) is a file of fixed size with
+ * the same records, see struct writer_ring_header.
+ *
+ * NOTE: the fields are in host byte order, as the probes.
+ */
+
+#ifndef WRITER_FORMAT_H
+#define WRITER_FORMAT_H
+
+#include <stdint.h> /* int*_t */
+
+/* the magics end with a NUL */
+#define WRITER_FORMAT_MAGIC    "NLMEAS\n"
+#define WRITER_RING_MAGIC      "NLRING\n"
+#define WRITER_FORMAT_VERSION  2
+
+/* optional columns, after id and round trip latency */
+
+/* forward, mirror residence and reverse components */
+#define WRITER_COLUMN_MIRROR     (1 << 0)
+/* send call to qdisc, qdisc to driver */
+#define WRITER_COLUMN_TX_STAGES  (1 << 1)
+/* RX wake-up latency */
+#define WRITER_COLUMN_RX_WAKEUP  (1 << 2)
+
+/* values of run_mode */
+#define WRITER_RUN_SINGLE_THREAD  0
+#define WRITER_RUN_MULTI_THREAD   1
+#define WRITER_RUN_BUSY_POLL      2
+#define WRITER_RUN_IO_URING       3
+
+/*
+ * values of send_time, where the send times come from
+ * (SEND_TIME_* in probe.h)
+ */
+
+/* kernel TX_SCHED timestamp */
+#define WRITER_SEND_TIME_HISTORY  0
+/* sender clock right before the send call (measurer -E payload) */
+#define WRITER_SEND_TIME_PAYLOAD  1
+/* kernel timestamp or, if not stored yet, the sender clock */
+#define WRITER_SEND_TIME_MERGE    2
+
+/*
+ * values of overrun_policy, what the sender did when it
+ * missed intervals (SENDER_OVERRUN_* in sender.h)
+ */
+
+/* exit */
+#define WRITER_OVERRUN_ABORT  0
+/* don't send the missed intervals */
+#define WRITER_OVERRUN_SKIP   1
+/* send them as soon as possible, see WRITER_RECORD_LATE */
+#define WRITER_OVERRUN_LATE   2
+
+struct writer_file_header {
+	/* WRITER_FORMAT_MAGIC and WRITER_FORMAT_VERSION */
+	char     magic[8];
+	uint32_t version;
+	/* the records start right after the header */
+	uint32_t header_size;
+
+	/* record layout */
+	uint32_t record_size;
+	/* WRITER_COLUMN_* */
+	uint32_t columns;
+
+	/* clock source of the absolute times */
+	uint32_t clock_id;
+	/* WRITER_SEND_TIME_* */
+	uint32_t send_time;
+	/* when the measurer started writing */
+	int64_t  start_ns;
+
+	/* run configuration */
+	uint32_t addr;
+	uint16_t port;
+	/* WRITER_RUN_* */
+	uint16_t run_mode;
+	uint64_t interval_ns;
+	uint64_t max_latency_ns;
+	uint32_t packet_count;
+	/* WRITER_OVERRUN_* */
+	uint32_t overrun_policy;
+
+	/* zero */
+	uint64_t reserved[4];
+};
+
+struct writer_record {
+	uint64_t id;
+	/* WRITER_RECORD_* below */
+	uint32_t flags;
+	uint32_t reserved;
+
+	/* round trip, zero if lost or duplicate */
+	int64_t  rtt_ns;
+	/*
+	 * send time (TX_SCHED kernel timestamp or the sender
+	 * clock, see WRITER_RECORD_PAYLOAD_SEND_TIME) and the
+	 * kernel receive timestamp, zero if unknown
+	 */
+	int64_t  send_ns;
+	int64_t  recv_ns;
+
+	/*
+	 * optional columns, valid with their flag:
+	 *
+	 * WRITER_COLUMN_MIRROR: forward, mirror residence
+	 * and reverse (WRITER_RECORD_MIRROR_TIMESTAMPS)
+	 *
+	 * WRITER_COLUMN_TX_STAGES: send call to qdisc
+	 * (WRITER_RECORD_TX_SCHED_DELAY) and qdisc to driver
+	 * (WRITER_RECORD_TX_QUEUE_DELAY)
+	 *
+	 * WRITER_COLUMN_RX_WAKEUP: RX wake-up latency
+	 * (WRITER_RECORD_RX_WAKEUP)
+	 */
+};
+
+/*
+ * Ring output: the measurer maps the file and keeps writing
+ * the latest `capacity` records in it, so other programs
+ * can map it too and read them with no system call.
+ *
+ * head and tail count the records ever written: the ones
+ * in the file are the sequence numbers from tail to head
+ * (excluded), and record `seq` is at
+ *
+ *   file.header_size + seq % capacity * file.record_size
+ *
+ * The measurer moves tail before overwriting records, then
+ * writes them and moves head. A reader loads head (acquire),
+ * copies the records it wants, loads tail again (after an
+ * acquire fence) and drops the ones before it, which may
+ * have been overwritten meanwhile.
+ */
+struct writer_ring_header {
+	/* magic is WRITER_RING_MAGIC, header_size a page */
+	struct writer_file_header file;
+	/* in records */
+	uint64_t capacity;
+
+	/* written by the measurer only */
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail;
+};
+
+/* values in flags, the same as RESULT_* in result_buffer.h */
+
+#define WRITER_RECORD_MIRROR_TIMESTAMPS  (1 << 0)
+/* the send time is the sender clock, not a kernel timestamp */
+#define WRITER_RECORD_PAYLOAD_SEND_TIME  (1 << 1)
+#define WRITER_RECORD_TX_SCHED_DELAY     (1 << 2)
+#define WRITER_RECORD_TX_QUEUE_DELAY     (1 << 3)
+#define WRITER_RECORD_RX_WAKEUP          (1 << 4)
+/* sent after its time (measurer -O late) */
+#define WRITER_RECORD_LATE               (1 << 5)
+/* timeout elapsed with no reply (only WRITE_IN_SENDER) */
+#define WRITER_RECORD_LOST               (1 << 6)
+/* a reply already received */
+#define WRITER_RECORD_DUPLICATE          (1 << 7)
+
+#endif /* WRITER_FORMAT_H */